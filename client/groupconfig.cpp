@@ -1,5 +1,6 @@
 #include "groupconfig.h"
 #include "utils.h"
+#include "../src/control_prot.h"
 
 #include <QDir>
 #include <QFile>
@@ -17,6 +18,12 @@ GroupConfig::GroupConfig(const QString &confFile, const QString &group)
     m_height = value(QStringLiteral("Height")).toInt();
     m_url = value(QStringLiteral("Url")).toUrl();
 
+    const QVariant buffers = value(QStringLiteral("Buffers"));
+    if (buffers.isValid()) {
+        m_buffers = qBound(2, buffers.toInt(), MAX_SHM_BUFFERS);
+    }
+    m_hugePages = value(QStringLiteral("HugePages")).toBool();
+
     const QString scriptPath = value(QStringLiteral("InjectScript")).toString();
     if (!scriptPath.isEmpty()) {
         QFile file(Utils::resolvedPath(scriptPath, QFileInfo(m_confFile).path()));
@@ -58,6 +65,16 @@ QString GroupConfig::injectScript() const
     return m_injectScript;
 }
 
+int GroupConfig::buffers() const
+{
+    return m_buffers;
+}
+
+bool GroupConfig::hugePages() const
+{
+    return m_hugePages;
+}
+
 QVariant GroupConfig::value(const QString &key) const
 {
     return QSettings(m_confFile, QSettings::IniFormat).value(QStringLiteral("%1/%2").arg(m_group, key));
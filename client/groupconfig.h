@@ -14,6 +14,8 @@ public:
     int height() const;
     QUrl url() const;
     QString injectScript() const;
+    int buffers() const;
+    bool hugePages() const;
 
 private:
     QVariant value(const QString &key) const;
@@ -27,4 +29,6 @@ private:
     int m_height = 0;
     QUrl m_url;
     QString m_injectScript;
+    int m_buffers = 3;
+    bool m_hugePages = false;
 };
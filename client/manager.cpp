@@ -26,22 +26,22 @@ Manager::Manager(const QString &confFile, bool tray, bool shm, QObject *parent)
     connect(m_socket, &QLocalSocket::stateChanged, this, [this](QLocalSocket::LocalSocketState state) {
         updateStatus();
         if (state == QLocalSocket::ConnectedState) {
-            QTimer::singleShot(0, this, &Manager::socketConnected);
+            // socketConnected is emitted once the layer replied to ring creation
+            QTimer::singleShot(0, this, &Manager::initRing);
         } else if (state == QLocalSocket::UnconnectedState) {
+            m_pendingMsgs.clear();
+            destroyRing();
             emit socketDisconnected();
             m_reconnectTimer->start();
         }
     });
-    connect(m_socket, &QLocalSocket::readyRead, this, [this]() {
-        while (true) {
-            QByteArray data = m_socket->read(REPLY_BUF_SIZE);
-            if (data.isEmpty()) {
-                return;
-            }
-            struct reply_struct *reply = reinterpret_cast<struct reply_struct*>(data.data());
-            emit replyReceived(reply);
-        }
-    });
+    connect(m_socket, &QLocalSocket::readyRead, this, &Manager::readReplies);
+
+    // Retry when the ring is full because layer didn't present for a while
+    m_ringTimer = new QTimer(this);
+    m_ringTimer->setSingleShot(true);
+    m_ringTimer->setInterval(16);
+    connect(m_ringTimer, &QTimer::timeout, this, &Manager::flushRing);
 
     m_reconnectTimer = new QTimer(this);
     m_reconnectTimer->setSingleShot(true);
@@ -94,6 +94,7 @@ Manager::Manager(const QString &confFile, bool tray, bool shm, QObject *parent)
 Manager::~Manager()
 {
     qDeleteAll(m_views);
+    destroyRing();
 }
 
 bool Manager::useShm() const
@@ -106,57 +107,233 @@ bool Manager::isConnected() const
     return m_socket->state() == QLocalSocket::ConnectedState;
 }
 
-bool Manager::writeFds(int fds[4], int nfd)
+bool Manager::writeMsg(uint32_t type, const void *payload, uint32_t size)
+{
+    if (!isConnected()) {
+        qWarning() << "Not connected";
+        return false;
+    }
+
+    if (m_pendingMsgs.isEmpty()) {
+        QMetaObject::invokeMethod(this, &Manager::flushMsgs, Qt::QueuedConnection);
+    }
+
+    struct msg_header hdr;
+    hdr.type = type;
+    hdr.size = size;
+    m_pendingMsgs.append(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    m_pendingMsgs.append(reinterpret_cast<const char*>(payload), size);
+    return true;
+}
+
+bool Manager::writeMsgWithFds(uint32_t type, const void *payload, uint32_t size, int *fds, int nfd)
 {
     if (!isConnected()) {
         qWarning() << "Not connected";
         return false;
     }
 
+    if (m_ringActive) {
+        // Fds go first over the socket, layer picks them up when it reads the message
+        char dummy = 0;
+        struct iovec iov;
+        iov.iov_base = &dummy;
+        iov.iov_len = sizeof(dummy);
+        if (!sendWithFds(&iov, 1, fds, nfd)) {
+            return false;
+        }
+        return writeMsg(type, payload, size);
+    }
+
+    // Keep ordering with already queued messages
+    flushMsgs();
+
+    struct msg_header hdr;
+    hdr.type = type;
+    hdr.size = size;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = const_cast<void*>(payload);
+    iov[1].iov_len = size;
+    return sendWithFds(iov, 2, fds, nfd);
+}
+
+bool Manager::sendWithFds(struct iovec *iov, int iovcnt, int *fds, int nfd)
+{
     struct msghdr msgh;
-    struct iovec iov;
     union {
         struct cmsghdr cmsgh;
-        char   control[CMSG_SPACE(sizeof(int) * 4)];
+        char   control[CMSG_SPACE(sizeof(int) * MSG_MAX_FDS)];
     } control_un;
 
-    // We must transmit at least 1 byte of real data in order
-    // to send some other ancillary data.
-    char placeholder = 'A';
-    iov.iov_base = &placeholder;
-    iov.iov_len = sizeof(char);
-
     msgh.msg_name = NULL;
     msgh.msg_namelen = 0;
-    msgh.msg_iov = &iov;
-    msgh.msg_iovlen = 1;
+    msgh.msg_iov = iov;
+    msgh.msg_iovlen = iovcnt;
     msgh.msg_control = control_un.control;
-    msgh.msg_controllen = CMSG_SPACE(sizeof(int)) * nfd;
+    msgh.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
+    msgh.msg_flags = 0;
 
-    // Write the fd as ancillary data
-    control_un.cmsgh.cmsg_len = CMSG_LEN(sizeof(int)) * nfd;
+    // Write the fds as ancillary data
+    control_un.cmsgh.cmsg_len = CMSG_LEN(sizeof(int) * nfd);
     control_un.cmsgh.cmsg_level = SOL_SOCKET;
     control_un.cmsgh.cmsg_type = SCM_RIGHTS;
     memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msgh)), fds, sizeof(int) * nfd);
 
-    int size = sendmsg(m_socket->socketDescriptor(), &msgh, 0);
-    if (size < 0) {
-        perror("sendsmg");
+    int ret = sendmsg(m_socket->socketDescriptor(), &msgh, MSG_NOSIGNAL);
+    if (ret < 0) {
+        perror("sendmsg");
         return false;
     }
     return true;
 }
 
-bool Manager::writeMsg(struct msg_struct *msg)
+void Manager::flushMsgs()
 {
-    if (!isConnected()) {
-        qWarning() << "Not connected";
-        return false;
+    if (m_pendingMsgs.isEmpty() || !isConnected()) {
+        m_pendingMsgs.clear();
+        return;
     }
 
-    m_socket->write(reinterpret_cast<char*>(msg), MSG_BUF_SIZE);
+    if (m_ringActive) {
+        flushRing();
+        return;
+    }
+
+    m_socket->write(m_pendingMsgs);
     m_socket->flush();
-    return true;
+    m_pendingMsgs.clear();
+}
+
+void Manager::flushRing()
+{
+    if (!m_ringActive || m_pendingMsgs.isEmpty()) {
+        return;
+    }
+
+    const uint32_t size = m_ring->size;
+    const uint32_t head = m_ring->head;
+    const uint32_t tail = __atomic_load_n(&m_ring->tail, __ATOMIC_ACQUIRE);
+    const uint32_t space = size - (head - tail);
+
+    // Only whole messages are published
+    uint32_t len = 0;
+    while (len + sizeof(struct msg_header) <= uint32_t(m_pendingMsgs.size())) {
+        struct msg_header hdr;
+        memcpy(&hdr, m_pendingMsgs.constData() + len, sizeof(hdr));
+        if (len + sizeof(hdr) + hdr.size > space) {
+            break;
+        }
+        len += sizeof(hdr) + hdr.size;
+    }
+
+    if (len > 0) {
+        uint8_t *data = reinterpret_cast<uint8_t*>(m_ring) + sizeof(struct ring_header);
+        const uint32_t start = head & (size - 1);
+        const uint32_t first = qMin(len, size - start);
+        memcpy(data + start, m_pendingMsgs.constData(), first);
+        memcpy(data, m_pendingMsgs.constData() + first, len - first);
+        __atomic_store_n(&m_ring->head, head + len, __ATOMIC_RELEASE);
+        m_pendingMsgs.remove(0, len);
+
+        // Layer I/O thread is sleeping, poke it through the socket
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_ring->need_wakeup, __ATOMIC_RELAXED)) {
+            const char dummy = 0;
+            m_socket->write(&dummy, sizeof(dummy));
+            m_socket->flush();
+        }
+    }
+
+    if (!m_pendingMsgs.isEmpty()) {
+        m_ringTimer->start();
+    }
+}
+
+void Manager::initRing()
+{
+    if (!m_settings.value(QStringLiteral("SharedRing"), true).toBool()) {
+        emit socketConnected();
+        return;
+    }
+
+    const uint32_t size = 64 * 1024;
+    m_ringMemsize = sizeof(struct ring_header) + size;
+
+    int fd = memfd_create("imgoverlay-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        emit socketConnected();
+        return;
+    }
+
+    if (ftruncate(fd, m_ringMemsize) < 0) {
+        perror("ftruncate");
+        ::close(fd);
+        emit socketConnected();
+        return;
+    }
+
+    void *memory = mmap(NULL, m_ringMemsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        ::close(fd);
+        emit socketConnected();
+        return;
+    }
+
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL);
+
+    m_ring = static_cast<struct ring_header*>(memory);
+    m_ring->size = size;
+
+    struct msg_create_ring msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.memsize = m_ringMemsize;
+    writeMsgWithFds(MSG_CREATE_RING, &msg, sizeof(msg), &fd, 1);
+    ::close(fd);
+}
+
+void Manager::destroyRing()
+{
+    m_ringActive = false;
+    m_ringTimer->stop();
+    if (m_ring) {
+        munmap(m_ring, m_ringMemsize);
+        m_ring = nullptr;
+    }
+}
+
+void Manager::readReplies()
+{
+    while (true) {
+        struct reply_header hdr;
+        if (m_socket->peek(reinterpret_cast<char*>(&hdr), sizeof(hdr)) != sizeof(hdr)) {
+            return;
+        }
+        const qint64 size = sizeof(hdr) + qint64(hdr.count) * sizeof(struct reply_struct);
+        if (m_socket->bytesAvailable() < size) {
+            return;
+        }
+        QByteArray data = m_socket->read(size);
+        for (uint32_t i = 0; i < hdr.count; ++i) {
+            struct reply_struct reply;
+            memcpy(&reply, data.constData() + sizeof(hdr) + i * sizeof(reply), sizeof(reply));
+            if (reply.msgtype == MSG_CREATE_RING) {
+                m_ringActive = reply.status == STATUS_OK;
+                if (!m_ringActive) {
+                    qWarning() << "Layer refused shared memory ring, using socket";
+                    destroyRing();
+                }
+                emit socketConnected();
+                continue;
+            }
+            emit replyReceived(&reply);
+        }
+    }
 }
 
 void Manager::initWebViews()
@@ -27,8 +27,9 @@ public:
 
     bool isConnected() const;
 
-    bool writeFds(int fds[4], int nfd);
-    bool writeMsg(struct msg_struct *msg);
+    // Messages are queued and sent together once control returns to the event loop
+    bool writeMsg(uint32_t type, const void *payload, uint32_t size);
+    bool writeMsgWithFds(uint32_t type, const void *payload, uint32_t size, int *fds, int nfd);
 
 Q_SIGNALS:
     void socketConnected();
@@ -36,6 +37,12 @@ Q_SIGNALS:
     void replyReceived(struct reply_struct *reply);
 
 private:
+    void flushMsgs();
+    void flushRing();
+    void readReplies();
+    void initRing();
+    void destroyRing();
+    bool sendWithFds(struct iovec *iov, int iovcnt, int *fds, int nfd);
     void initWebViews();
     void showView(int index);
     void updateStatus();
@@ -45,6 +52,13 @@ private:
     QString m_socketPath;
     QLocalSocket *m_socket;
     QTimer *m_reconnectTimer;
+    QByteArray m_pendingMsgs;
+
+    // shared memory ring, client -> layer
+    struct ring_header *m_ring = nullptr;
+    uint32_t m_ringMemsize = 0;
+    bool m_ringActive = false;
+    QTimer *m_ringTimer;
     QVector<WebView*> m_views;
 
     QLabel *m_statusLabel;
@@ -43,11 +43,21 @@ WebView::WebView(uint8_t id, const GroupConfig &conf, Manager *manager, QWidget
         connect(window, &QQuickWindow::sceneGraphInitialized, this, [=]() {
             connect(w->quickWindow(), &QQuickWindow::afterRendering, this, &WebView::initDmaBuf, Qt::DirectConnection);
             connect(m_manager, &Manager::socketConnected, this, [this]() {
+                m_seq = 0;
+                m_created = false;
                 if (m_fbo) {
                     sendCreateImage();
                 }
             });
         });
+        connect(m_manager, &Manager::socketDisconnected, this, [this]() {
+            m_created = false;
+        });
+        connect(m_manager, &Manager::replyReceived, this, [this](struct reply_struct *reply) {
+            if (reply->id == m_id && reply->msgtype == MSG_CREATE_IMAGE) {
+                m_created = reply->status == STATUS_OK;
+            }
+        });
     } else {
         initShm();
     }
@@ -74,32 +84,78 @@ WebView::~WebView()
 bool WebView::eventFilter(QObject *o, QEvent *e)
 {
     if (o == focusProxy() && e->type() == QEvent::Paint) {
-        QTimer::singleShot(0, this, [=]() {
-            if (m_waitReply || !m_manager->isConnected()) {
-                m_updateTimer->start();
-                return;
-            }
-            m_updateTimer->stop();
-
-            uint8_t buffer = m_buffer;
-            m_buffer = (m_buffer + 1) % 2;
-            uchar *memory = (uchar*)m_memory + (PIXELS_SIZE(m_conf.width(), m_conf.height()) * buffer);
-            QImage img(memory, m_conf.width(), m_conf.height(), QImage::Format_RGBA8888);
-            img.fill(Qt::transparent);
-            render(&img);
-
-            char buf[MSG_BUF_SIZE];
-            msg_struct *msg = (msg_struct*)buf;
-            msg->type = MSG_UPDATE_IMAGE_CONTENTS;
-            msg->update_image_contents.id = m_id;
-            msg->update_image_contents.buffer = buffer;
-            m_manager->writeMsg(msg);
-            m_waitReply = true;
-        });
+        m_damage += static_cast<QPaintEvent*>(e)->region();
+        QTimer::singleShot(0, this, &WebView::renderShm);
     }
     return QWebEngineView::eventFilter(o, e);
 }
 
+void WebView::renderShm()
+{
+    if (!m_created || !m_manager->isConnected()) {
+        m_updateTimer->start();
+        return;
+    }
+
+    const int buffer = acquireBuffer();
+    if (buffer < 0) {
+        // All buffers still in use by layer, retry on next reply
+        m_renderPending = true;
+        return;
+    }
+    m_renderPending = false;
+    m_updateTimer->stop();
+
+    // Qt native format, painting into it needs no conversion
+    uchar *memory = (uchar*)m_memory + (PIXELS_SIZE(m_conf.width(), m_conf.height(), SHM_FORMAT_BGRA8) * buffer);
+    QImage img(memory, m_conf.width(), m_conf.height(), QImage::Format_ARGB32_Premultiplied);
+    img.fill(Qt::transparent);
+    render(&img);
+
+    m_bufferSeq[buffer] = ++m_seq;
+
+    msg_update_image_contents msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.id = m_id;
+    msg.buffer = buffer;
+    msg.seq = m_seq;
+    fillDamage(&msg);
+    m_manager->writeMsg(MSG_UPDATE_IMAGE_CONTENTS, &msg, sizeof(msg));
+}
+
+int WebView::acquireBuffer() const
+{
+    // Buffer holding a frame older than the one layer acquired last is free,
+    // pick the oldest so the layer never sees a buffer being overwritten
+    int buffer = -1;
+    for (int i = 0; i < m_bufferSeq.size(); ++i) {
+        const uint64_t seq = m_bufferSeq.at(i);
+        if (seq && seq >= m_releasedSeq) {
+            continue;
+        }
+        if (buffer < 0 || seq < m_bufferSeq.at(buffer)) {
+            buffer = i;
+        }
+    }
+    return buffer;
+}
+
+void WebView::fillDamage(struct msg_update_image_contents *msg)
+{
+    const QRegion damage = m_damage.intersected(QRect(0, 0, m_conf.width(), m_conf.height()));
+    m_damage = QRegion();
+
+    msg->ndamage = 0;
+    if (damage.rectCount() > MAX_DAMAGE_RECTS) {
+        const QRect r = damage.boundingRect();
+        msg->damage[msg->ndamage++] = {uint16_t(r.x()), uint16_t(r.y()), uint16_t(r.width()), uint16_t(r.height())};
+        return;
+    }
+    for (const QRect &r : damage) {
+        msg->damage[msg->ndamage++] = {uint16_t(r.x()), uint16_t(r.y()), uint16_t(r.width()), uint16_t(r.height())};
+    }
+}
+
 void WebView::contextMenuEvent(QContextMenuEvent *event)
 {
     QMenu menu;
@@ -147,50 +203,79 @@ void WebView::initShm()
     });
 
     connect(m_manager, &Manager::socketConnected, this, [this]() {
+        m_bufferSeq.fill(0);
+        m_seq = 0;
+        m_releasedSeq = 0;
+        m_created = false;
         sendCreateImage();
-        m_waitReply = true;
-        m_buffer = 0;
     });
 
     connect(m_manager, &Manager::socketDisconnected, this, [this]() {
-        m_waitReply = false;
+        m_created = false;
     });
 
     connect(m_manager, &Manager::replyReceived, this, [this](struct reply_struct *reply) {
         if (reply->id != m_id) {
             return;
         }
-        m_waitReply = false;
+        if (reply->msgtype == MSG_CREATE_IMAGE) {
+            m_created = reply->status == STATUS_OK;
+            focusProxy()->update();
+        } else if (reply->msgtype == MSG_UPDATE_IMAGE_CONTENTS && reply->status == STATUS_OK) {
+            m_releasedSeq = qMax(m_releasedSeq, reply->seq);
+            if (m_renderPending) {
+                renderShm();
+            }
+        }
     });
 }
 
 void WebView::initMemory()
 {
-    m_memsize = PIXELS_SIZE(m_conf.width(), m_conf.height()) * 2;
+    m_bufferSeq.fill(0, m_conf.buffers());
+    const uint32_t size = PIXELS_SIZE(m_conf.width(), m_conf.height(), SHM_FORMAT_BGRA8) * m_conf.buffers();
+
+    if (m_conf.hugePages()) {
+        // Size must be a multiple of the huge page size
+        const uint32_t hugePageSize = 2 * 1024 * 1024;
+        if (createMemory(MFD_HUGETLB | MFD_HUGE_2MB, (size + hugePageSize - 1) & ~(hugePageSize - 1))) {
+            qDebug() << "Using huge pages";
+            return;
+        }
+        qWarning() << "Huge pages not available, using normal pages";
+    }
+    createMemory(0, size);
+}
 
-    m_memfd = memfd_create("imgoverlay", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+bool WebView::createMemory(unsigned flags, uint32_t size)
+{
+    m_memfd = memfd_create("imgoverlay", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
     if (m_memfd < 0) {
         perror("memfd_create");
-        return;
+        return false;
     }
 
-    if (ftruncate(m_memfd, m_memsize) < 0) {
+    if (ftruncate(m_memfd, size) < 0) {
         perror("ftruncate");
         ::close(m_memfd);
         m_memfd = -1;
-        return;
+        return false;
     }
 
-    m_memory = mmap(NULL, m_memsize, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+    // Huge pages are reserved here, fails if the pool is exhausted
+    m_memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
     if (m_memory == MAP_FAILED) {
         perror("mmap");
+        m_memory = nullptr;
         ::close(m_memfd);
         m_memfd = -1;
-        return;
+        return false;
     }
 
     fcntl(m_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
     fcntl(m_memfd, F_ADD_SEALS, F_SEAL_SEAL);
+    m_memsize = size;
+    return true;
 }
 
 void WebView::initDmaBuf()
@@ -251,6 +336,15 @@ void WebView::initDmaBuf()
     }
 
     m_fbo = textureId;
+
+    // Explicit sync, layer waits for rendering of each frame to finish
+    m_eglCreateSyncKHR = reinterpret_cast<decltype(m_eglCreateSyncKHR)>(eglGetProcAddress("eglCreateSyncKHR"));
+    m_eglDestroySyncKHR = reinterpret_cast<decltype(m_eglDestroySyncKHR)>(eglGetProcAddress("eglDestroySyncKHR"));
+    m_eglDupNativeFenceFDANDROID = reinterpret_cast<decltype(m_eglDupNativeFenceFDANDROID)>(eglGetProcAddress("eglDupNativeFenceFDANDROID"));
+    if (m_eglCreateSyncKHR && m_eglDestroySyncKHR && m_eglDupNativeFenceFDANDROID) {
+        connect(w, &QQuickWindow::afterRendering, this, &WebView::signalDmaBufFrame, Qt::DirectConnection);
+    }
+
     QMetaObject::invokeMethod(this, [this]() {
         qDebug() << "Using DMA-BUF";
         if (m_manager->isConnected()) {
@@ -259,36 +353,70 @@ void WebView::initDmaBuf()
     }, Qt::QueuedConnection);
 }
 
+void WebView::signalDmaBufFrame()
+{
+    // Scene graph render thread, its context is current
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    void *sync = m_eglCreateSyncKHR(dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+    if (!sync) {
+        return;
+    }
+    // Fence fd exists only once the fence command was flushed
+    QOpenGLContext::currentContext()->functions()->glFlush();
+    const int fence = m_eglDupNativeFenceFDANDROID(dpy, sync);
+    m_eglDestroySyncKHR(dpy, sync);
+    if (fence < 0) {
+        return;
+    }
+    QMetaObject::invokeMethod(this, [this, fence]() {
+        sendDmaBufFrame(fence);
+    }, Qt::QueuedConnection);
+}
+
+void WebView::sendDmaBufFrame(int fence)
+{
+    if (m_created && m_manager->isConnected()) {
+        msg_update_image_contents msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.id = m_id;
+        msg.seq = ++m_seq;
+        msg.acquire_fence = 1;
+        m_manager->writeMsgWithFds(MSG_UPDATE_IMAGE_CONTENTS, &msg, sizeof(msg), &fence, 1);
+    }
+    ::close(fence);
+}
+
 void WebView::sendCreateImage()
 {
-    char buf[MSG_BUF_SIZE];
-    memset(buf, 0, MSG_BUF_SIZE);
-    msg_struct *msg = (msg_struct*)buf;
-    msg->type = MSG_CREATE_IMAGE;
-    msg->create_image.id = m_id;
-    msg->create_image.x = m_conf.x();
-    msg->create_image.y = m_conf.y();
-    msg->create_image.width = m_conf.width();
-    msg->create_image.height = m_conf.height();
-    msg->create_image.visible = 1;
-    msg->create_image.memsize = m_memsize;
-    msg->create_image.format = m_format;
-    msg->create_image.modifier = m_modifier;
-    memcpy(msg->create_image.strides, m_strides, sizeof(m_strides));
-    memcpy(msg->create_image.offsets, m_offsets, sizeof(m_offsets));
+    msg_create_image msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.id = m_id;
+    msg.x = m_conf.x();
+    msg.y = m_conf.y();
+    msg.width = m_conf.width();
+    msg.height = m_conf.height();
+    msg.visible = 1;
+    msg.memsize = m_memsize;
+    msg.format = m_format;
+    msg.modifier = m_modifier;
+    memcpy(msg.strides, m_strides, sizeof(m_strides));
+    memcpy(msg.offsets, m_offsets, sizeof(m_offsets));
 
     int *fds = nullptr;
     if (m_memfd > 0) {
-        msg->create_image.nfd = 1;
-        msg->create_image.flip = 0;
+        msg.nfd = 1;
+        msg.flip = 0;
+        msg.nbuffers = m_bufferSeq.size();
+        // QImage::Format_ARGB32_Premultiplied on little endian
+        msg.shm_format = SHM_FORMAT_BGRA8;
+        msg.premultiplied = 1;
         fds = &m_memfd;
     } else {
-        msg->create_image.nfd = m_nfd;
-        msg->create_image.flip = 1;
+        msg.nfd = m_nfd;
+        msg.flip = 1;
         fds = m_dmabufs;
     }
-    m_manager->writeMsg(msg);
-    m_manager->writeFds(fds, msg->create_image.nfd);
+    m_manager->writeMsgWithFds(MSG_CREATE_IMAGE, &msg, sizeof(msg), fds, msg.nfd);
 }
 
 void WebPage::javaScriptConsoleMessage(QWebEnginePage::JavaScriptConsoleMessageLevel level, const QString &message, int lineNumber, const QString &sourceID)
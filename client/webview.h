@@ -3,6 +3,8 @@
 #include "manager.h"
 #include "groupconfig.h"
 
+#include <QRegion>
+#include <QVector>
 #include <QWebEngineView>
 
 class QTimer;
@@ -23,20 +25,30 @@ private:
 
     void initShm();
     void initMemory();
+    bool createMemory(unsigned flags, uint32_t size);
     void initDmaBuf();
+    void signalDmaBufFrame();
+    void sendDmaBufFrame(int fence);
     void sendCreateImage();
+    void renderShm();
+    int acquireBuffer() const;
+    void fillDamage(struct msg_update_image_contents *msg);
 
     uint8_t m_id = 0;
     GroupConfig m_conf;
     Manager *m_manager;
 
     QTimer *m_updateTimer;
-    bool m_waitReply = false;
+    bool m_created = false;
+    bool m_renderPending = false;
 
     int m_memfd = -1;
     void *m_memory = nullptr;
     uint32_t m_memsize = 0;
-    uint32_t m_buffer = 0; // 0 - front, 1 - back
+    QVector<uint64_t> m_bufferSeq; // sequence of frame in buffer, 0 - never used
+    uint64_t m_seq = 0; // last sent frame
+    uint64_t m_releasedSeq = 0; // buffers older than this are free
+    QRegion m_damage;
 
     int m_dmabufs[4] = {-1};
     int32_t m_format = 0;
@@ -46,6 +58,10 @@ private:
     int m_nfd = 0;
     void *m_eglImage = nullptr;
     unsigned m_fbo = 0;
+    // EGL_ANDROID_native_fence_sync, resolved on the render thread
+    void *(*m_eglCreateSyncKHR)(void*, unsigned, const int*) = nullptr;
+    unsigned (*m_eglDestroySyncKHR)(void*, void*) = nullptr;
+    int (*m_eglDupNativeFenceFDANDROID)(void*, void*) = nullptr;
 };
 
 class WebPage : public QWebEnginePage
@@ -2,23 +2,97 @@
 #include "control_prot.h"
 #include "overlay.h"
 #include "mesa/util/os_socket.h"
+#include "mesa/util/os_time.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 
 #include <string.h>
 #include <iostream>
+#include <algorithm>
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0x4000
 #endif
 
-#define MAX_MEM_SIZE 20 * 1024 * 1024
+#define RECV_CHUNK_SIZE 4096
+
+#define EPOLL_SERVER_ID 0
+#define EPOLL_EVENT_ID 0xFFFFFFFF
+
+bool OverlayImage::damageSince(uint64_t since, std::vector<OverlayRect> &rects) const
+{
+    rects.clear();
+
+    if (since == 0 || since > serial || serial - since > MAX_DAMAGE_HISTORY) {
+        return false;
+    }
+
+    for (uint64_t s = since + 1; s <= serial; ++s) {
+        const OverlayDamage &d = damage[s % MAX_DAMAGE_HISTORY];
+        if (d.full) {
+            return false;
+        }
+        rects.insert(rects.end(), d.rects, d.rects + d.count);
+    }
+    return true;
+}
+
+OverlayFence::~OverlayFence()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+OverlayMemory::~OverlayMemory()
+{
+    if (data) {
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
 
-Control::Control(const std::string &socketPath)
+Control::Control(const std::string &socketPath, size_t maxImageMem, size_t maxTotalMem, size_t maxImages)
     : m_socketPath(socketPath)
+    , m_maxImageMem(maxImageMem)
+    , m_maxTotalMem(maxTotalMem)
+    , m_maxImages(maxImages)
+    , m_snapshot(new ControlSnapshot)
+    , m_state(0)
+    , m_readers(0)
+    , m_reclaimPending(false)
+    , m_quit(false)
 {
 }
 
 Control::~Control()
 {
+    if (m_thread.joinable()) {
+        m_quit = true;
+        wakeup();
+        m_thread.join();
+    }
+
+    for (auto &it : m_clients) {
+        closeClient(it.second);
+    }
+    m_clients.clear();
+    publish();
+    reclaim(true);
+    delete m_snapshot.load();
+
+    if (m_event >= 0) {
+        close(m_event);
+        m_event = -1;
+    }
+    if (m_epoll >= 0) {
+        close(m_epoll);
+        m_epoll = -1;
+    }
     if (m_server >= 0) {
         os_socket_close(m_server);
         unlink(m_socketPath.c_str());
@@ -26,153 +100,357 @@ Control::~Control()
     }
 }
 
-const std::unordered_map<uint8_t, OverlayImage> &Control::images() const
+const ControlSnapshot *Control::acquire()
+{
+    std::call_once(m_initFlag, &Control::init, this);
+
+    // Reader count must be raised before loading the pointer, I/O thread
+    // frees retired snapshots only when it sees no readers after the swap
+    m_readers.fetch_add(1);
+    const ControlSnapshot *snapshot = m_snapshot.load();
+    snapshot->refs.fetch_add(1);
+    if (m_readers.fetch_sub(1) == 1 && m_reclaimPending.load()) {
+        wakeup();
+    }
+    return snapshot;
+}
+
+void Control::release(const ControlSnapshot *snapshot)
+{
+    // Retired is set before the I/O thread looks at refs, one of us frees it
+    if (snapshot->refs.fetch_sub(1) == 1 && snapshot->retired.load()) {
+        wakeup();
+    }
+}
+
+uint64_t Control::state()
 {
-    return m_images;
+    std::call_once(m_initFlag, &Control::init, this);
+    return m_state.load(std::memory_order_acquire);
+}
+
+void Control::wakeup()
+{
+    uint64_t v = 1;
+    if (write(m_event, &v, sizeof(v)) < 0) {
+        std::cerr << "eventfd write error: " << strerror(errno) << std::endl;
+    }
+}
+
+// Mapped shared memory of clients has to stay as large as they said, or
+// reading it faults with SIGBUS. Clients seal their memfds against that.
+static bool check_memfd(int fd, uint64_t memsize)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < memsize) {
+        std::cerr << "Memfd smaller than memsize " << memsize << std::endl;
+        return false;
+    }
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        std::cerr << "Memfd not sealed against shrinking" << std::endl;
+        return false;
+    }
+    return true;
 }
 
 // https://github.com/a-darwish/memfd-examples
-static int receive_fds(int socket, int fds[4])
+static ssize_t receive_data(int socket, std::vector<char> &buf, std::vector<int> &fds)
 {
     struct msghdr msgh;
     struct iovec iov;
     union {
         struct cmsghdr cmsgh;
-        char control[CMSG_SPACE(sizeof(int)) * 4];
+        char control[CMSG_SPACE(sizeof(int) * MSG_MAX_FDS)];
     } control_un;
     struct cmsghdr *cmsgh;
 
-    // The sender must transmit at least 1 byte of real data
-    // in order to send some other ancillary data (the fd).
-    char placeholder;
-    iov.iov_base = &placeholder;
-    iov.iov_len = sizeof(char);
+    const size_t offset = buf.size();
+    buf.resize(offset + RECV_CHUNK_SIZE);
+    iov.iov_base = buf.data() + offset;
+    iov.iov_len = RECV_CHUNK_SIZE;
 
     msgh.msg_name = NULL;
     msgh.msg_namelen = 0;
     msgh.msg_iov = &iov;
     msgh.msg_iovlen = 1;
     msgh.msg_control = control_un.control;
-    msgh.msg_controllen =  sizeof(control_un.control);
+    msgh.msg_controllen = sizeof(control_un.control);
+    msgh.msg_flags = 0;
 
-    int size = recvmsg(socket, &msgh, 0);
-    if (size == -1) {
-#ifndef NDEBUG
-        std::cerr << "recvmsg error " << strerror(errno) << std::endl;
-#endif
-        return -1;
+    ssize_t size = recvmsg(socket, &msgh, MSG_CMSG_CLOEXEC);
+    buf.resize(offset + std::max<ssize_t>(size, 0));
+    if (size <= 0) {
+        return size;
     }
 
-    if (size != 1) {
-        std::cerr << "Expected a placeholder message data of length 1, got " << size << std::endl;
-        return -2;
+    for (cmsgh = CMSG_FIRSTHDR(&msgh); cmsgh; cmsgh = CMSG_NXTHDR(&msgh, cmsgh)) {
+        if (cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
+            std::cerr << "invalid cmsg " << cmsgh->cmsg_level << " " << cmsgh->cmsg_type << std::endl;
+            continue;
+        }
+        const size_t nfd = (cmsgh->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nfd; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsgh) + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
     }
 
-    cmsgh = CMSG_FIRSTHDR(&msgh);
-    if (!cmsgh) {
-        std::cerr << "Expected one recvmsg() header with a passed memfd fd. Got zero headers!" << std::endl;
-        return -3;
+    if (msgh.msg_flags & MSG_CTRUNC) {
+        std::cerr << "Too many fds received" << std::endl;
+        errno = EPROTO;
+        return -1;
     }
+    return size;
+}
+
+void Control::run()
+{
+    struct epoll_event events[MAX_CLIENT_COUNT + 2];
+
+    while (true) {
+        // Retired snapshots are reclaimed when their last reader wakes us
+        int timeout = -1;
+        // Ask ring clients to wake us up, unless they raced us with new data
+        if (setNeedWakeup(true)) {
+            timeout = 0;
+        }
+        int n = epoll_wait(m_epoll, events, MAX_CLIENT_COUNT + 2, timeout);
+        setNeedWakeup(false);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait error: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            const uint32_t id = events[i].data.u32;
+            if (id == EPOLL_EVENT_ID) {
+                if (m_quit) {
+                    return;
+                }
+                uint64_t v;
+                if (read(m_event, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+                    std::cerr << "eventfd read error: " << strerror(errno) << std::endl;
+                }
+                continue;
+            }
+            if (id == EPOLL_SERVER_ID) {
+                acceptClients();
+                continue;
+            }
+            auto it = m_clients.find(id);
+            if (it == m_clients.end()) {
+                continue;
+            }
+            ControlClient &client = it->second;
+            // With ring, messages are processed below
+            if (!receiveSocket(client) || (!client.ring && !processMsgs(client))) {
+                m_closedClients.push_back(client.id);
+            }
+        }
+
+        for (auto &it : m_clients) {
+            ControlClient &client = it.second;
+            if (!client.ring) {
+                continue;
+            }
+            ssize_t r = receiveRing(client);
+            if (r < 0 || (r > 0 && !processMsgs(client))) {
+                m_closedClients.push_back(client.id);
+            }
+        }
+
+        for (uint32_t id : m_closedClients) {
+            auto it = m_clients.find(id);
+            if (it != m_clients.end()) {
+                sendPendingReplies(it->second);
+                closeClient(it->second);
+                m_clients.erase(it);
+            }
+        }
+        m_closedClients.clear();
 
-    if (cmsgh->cmsg_level != SOL_SOCKET) {
-        std::cerr << "invalid cmsg_level " << cmsgh->cmsg_level << std::endl;
-        return -4;
+        publish();
+        reclaim(false);
     }
+}
 
-    if (cmsgh->cmsg_type != SCM_RIGHTS) {
-        std::cerr << "invalid cmsg_type " << cmsgh->cmsg_type << std::endl;
-        return -5;
+void Control::publish()
+{
+    if (!m_dirty) {
+        return;
     }
+    m_dirty = false;
+
+    ControlSnapshot *snapshot = new ControlSnapshot;
+    snapshot->images = m_images;
+    snapshot->generation = m_generation;
 
-    const size_t nfd = (cmsgh->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
-    memset(fds, -1, sizeof(int) * 4);
-    for (size_t i = 0; i < nfd; ++i) {
-        fds[i] = ((int*)CMSG_DATA(cmsgh))[i];
+    ControlSnapshot *old = m_snapshot.exchange(snapshot);
+
+    // Not only images with contents, those get none without a new generation
+    bool visible = false;
+    for (const auto &it : m_images) {
+        visible |= it.second.visible;
+    }
+    m_state.store(m_generation << 1 | (visible ? 1 : 0), std::memory_order_release);
+
+    // Images destroyed since old was published are still visible in it,
+    // and replies must not release shm buffers readers may be copying from
+    old->destroyed.swap(m_destroyedImages);
+    for (auto &it : m_clients) {
+        ControlClient &client = it.second;
+        if (client.replyCount == 0) {
+            continue;
+        }
+        struct reply_header rhdr;
+        rhdr.count = client.replyCount;
+        memcpy(client.replies.data(), &rhdr, sizeof(rhdr));
+        old->replies.push_back({client.id, std::move(client.replies)});
+        client.replies.clear();
+        client.replyCount = 0;
     }
-    return 0;
+    old->retired.store(true);
+    m_retired.push_back(old);
 }
 
-void Control::processSocket()
+// Sends the replies still waiting for readers right away, before client
+// is disconnected. Its images are destroyed with it anyway.
+void Control::sendPendingReplies(ControlClient &client)
 {
-    init();
+    for (ControlSnapshot *snapshot : m_retired) {
+        auto &replies = snapshot->replies;
+        for (auto it = replies.begin(); it != replies.end();) {
+            if (it->first != client.id) {
+                ++it;
+                continue;
+            }
+            os_socket_send(client.fd, it->second.data(), it->second.size(), MSG_NOSIGNAL);
+            it = replies.erase(it);
+        }
+    }
 
-    if (m_server < 0) {
+    if (client.replyCount > 0) {
+        struct reply_header rhdr;
+        rhdr.count = client.replyCount;
+        memcpy(client.replies.data(), &rhdr, sizeof(rhdr));
+        os_socket_send(client.fd, client.replies.data(), client.replies.size(), MSG_NOSIGNAL);
+        client.replies.clear();
+        client.replyCount = 0;
+    }
+}
+
+void Control::reclaim(bool force)
+{
+    if (m_retired.empty()) {
         return;
     }
+    if (!force) {
+        m_reclaimPending.store(true);
+        if (m_readers.load() != 0) {
+            return;
+        }
+        m_reclaimPending.store(false);
+    }
 
-    // Wait for client
-    if (m_client < 0) {
-        m_client = os_socket_accept(m_server);
-        if (m_client >= 0) {
-#ifndef NDEBUG
-            std::cout << "Client connected" << std::endl;
-#endif
-            os_socket_block(m_client, false);
-        } else {
+    // In order, so neither unmapping nor replies overtake an older snapshot
+    size_t count = 0;
+    for (ControlSnapshot *snapshot : m_retired) {
+        if (!force && snapshot->refs.load() != 0) {
+            break;
+        }
+        count++;
+        for (OverlayImage &img : snapshot->destroyed) {
+            destroyImage(img);
+        }
+        for (const auto &reply : snapshot->replies) {
+            auto it = m_clients.find(reply.first);
+            if (it != m_clients.end()) {
+                os_socket_send(it->second.fd, reply.second.data(), reply.second.size(), MSG_NOSIGNAL);
+            }
+        }
+        delete snapshot;
+    }
+    m_retired.erase(m_retired.begin(), m_retired.begin() + count);
+}
+
+bool Control::setNeedWakeup(bool wakeup)
+{
+    bool pending = false;
+    for (auto &it : m_clients) {
+        ControlClient &client = it.second;
+        if (!client.ring) {
+            continue;
+        }
+        __atomic_store_n(&client.ring->need_wakeup, wakeup ? 1 : 0, __ATOMIC_SEQ_CST);
+        if (wakeup && __atomic_load_n(&client.ring->head, __ATOMIC_SEQ_CST) != client.ringTail) {
+            pending = true;
+        }
+    }
+    return pending;
+}
+
+void Control::acceptClients()
+{
+    while (true) {
+        int fd = os_socket_accept(m_server);
+        if (fd < 0) {
 #ifndef NDEBUG
             if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
                 std::cerr << "Socket error: " << strerror(errno) << std::endl;
             }
 #endif
+            return;
+        }
+
+        if (m_clients.size() >= MAX_CLIENT_COUNT) {
+            std::cerr << "Client count limit reached" << std::endl;
+            os_socket_close(fd);
+            continue;
+        }
+
+        os_socket_block(fd, false);
+
+        ControlClient client;
+        client.fd = fd;
+        // 0 is the server, ids are never reused so renderers see new images
+        client.id = ++m_lastClientId & 0xFFFFFF;
+        if (client.id == EPOLL_SERVER_ID) {
+            client.id = ++m_lastClientId & 0xFFFFFF;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = client.id;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            std::cerr << "epoll_ctl error: " << strerror(errno) << std::endl;
+            os_socket_close(fd);
+            continue;
         }
-        return;
-    }
 
-    // Read from client
-    while (true) {
-        // Get memfd
-        if (m_waitingForFd) {
-            m_waitingForFd = false;
-            int fds[4];
-            int ret = receive_fds(m_client, fds);
-            if (ret == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    m_waitingForFd = true;
-                    return;
-                }
 #ifndef NDEBUG
-                std::cout << "Client disconnected" << std::endl;
+        std::cout << "Client " << client.id << " connected" << std::endl;
 #endif
-                closeClient();
-                return;
-            } else if (ret < 0) {
-                std::cerr << "Error receiving fd " << ret << std::endl;
-                closeClient();
-                return;
-            }
-            OverlayImage img = m_images.at(m_waitingId);
-            if (img.memsize) {
-                img.memfd = fds[0];
-                img.memory = mmap(NULL, img.memsize, PROT_READ, MAP_PRIVATE, img.memfd, 0);
-                if (img.memory == MAP_FAILED) {
-                    std::cerr << "mmap error: " << strerror(errno) << std::endl;
-                    closeClient();
-                    return;
-                }
-            } else {
-                for (int i = 0; i < img.nfd; ++i) {
-                    img.dmabufs[i] = fds[i];
-                }
-            }
-            m_images[m_waitingId] = img;
-        }
-        // Get message
-        char buf[MSG_BUF_SIZE];
-        ssize_t n = os_socket_recv(m_client, buf, MSG_BUF_SIZE, 0);
-        if (n == MSG_BUF_SIZE) {
-            char rbuf[REPLY_BUF_SIZE];
-            memset(rbuf, 0, REPLY_BUF_SIZE);
-            struct reply_struct *reply = reinterpret_cast<struct reply_struct*>(rbuf);
-            processMsg(reinterpret_cast<struct msg_struct*>(buf), reply);
-            os_socket_send(m_client, reply, REPLY_BUF_SIZE, MSG_NOSIGNAL);
-            if (reply->status == STATUS_ERROR) {
-                closeClient();
-                return;
-            }
-        }
+        m_clients.insert({client.id, client});
+    }
+}
+
+bool Control::receiveSocket(ControlClient &client)
+{
+    // With ring the socket only carries fds, bytes sent with them are dummy
+    std::vector<char> &buffer = client.ring ? m_discardBuffer : client.recvBuffer;
+
+    // Read everything the client sent
+    while (true) {
+        ssize_t n = receive_data(client.fd, buffer, client.recvFds);
         if (n == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
+                break;
             }
 #ifndef NDEBUG
             if (errno != ECONNRESET) {
@@ -182,72 +460,205 @@ void Control::processSocket()
         }
         if (n <= 0) {
 #ifndef NDEBUG
-            std::cout << "Client disconnected" << std::endl;
+            std::cout << "Client " << client.id << " disconnected" << std::endl;
 #endif
-            closeClient();
-            return;
+            return false;
+        }
+        // Short read means the socket is drained, no need for another recvmsg
+        if (n < RECV_CHUNK_SIZE) {
+            break;
+        }
+    }
+
+    m_discardBuffer.clear();
+    return true;
+}
+
+ssize_t Control::receiveRing(ControlClient &client)
+{
+    // Client can write anything to the shared header, only head is read from it
+    const uint32_t size = client.ringSize;
+    const uint32_t tail = client.ringTail;
+    const uint32_t head = __atomic_load_n(&client.ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+
+    const uint32_t avail = head - tail;
+    if (avail > size) {
+        std::cerr << "Invalid ring head " << head << std::endl;
+        return -1;
+    }
+
+    const uint32_t start = tail & (size - 1);
+    const uint32_t first = std::min(avail, size - start);
+    client.recvBuffer.insert(client.recvBuffer.end(), client.ringData + start, client.ringData + start + first);
+    client.recvBuffer.insert(client.recvBuffer.end(), client.ringData, client.ringData + (avail - first));
+
+    client.ringTail = head;
+    __atomic_store_n(&client.ring->tail, head, __ATOMIC_RELEASE);
+    return avail;
+}
+
+bool Control::processMsgs(ControlClient &client)
+{
+    if (client.replyCount == 0) {
+        client.replies.resize(sizeof(struct reply_header));
+    }
+    uint32_t count = 0;
+    bool ok = true;
+
+    size_t offset = 0;
+    while (ok && client.recvBuffer.size() - offset >= sizeof(struct msg_header)) {
+        struct msg_header hdr;
+        memcpy(&hdr, client.recvBuffer.data() + offset, sizeof(hdr));
+        if (hdr.size > MSG_MAX_SIZE) {
+            std::cerr << "Invalid msg size " << hdr.size << std::endl;
+            ok = false;
+            break;
         }
+        if (client.recvBuffer.size() - offset < sizeof(hdr) + hdr.size) {
+            break;
+        }
+
+        union msg_payload msg;
+        memset(&msg, 0, sizeof(msg));
+        memcpy(&msg, client.recvBuffer.data() + offset + sizeof(hdr), std::min<size_t>(hdr.size, sizeof(msg)));
+        offset += sizeof(hdr) + hdr.size;
+
+        // Failed messages only get an error reply, the stream is still in sync
+        struct reply_struct reply;
+        memset(&reply, 0, sizeof(reply));
+        ok = processMsg(client, hdr.type, &msg, &reply);
+
+        const char *r = reinterpret_cast<const char*>(&reply);
+        client.replies.insert(client.replies.end(), r, r + sizeof(reply));
+        count++;
     }
+    client.recvBuffer.erase(client.recvBuffer.begin(), client.recvBuffer.begin() + offset);
+
+    // Replies are sent batched once readers can't see the previous state
+    if (count > 0) {
+        client.replyCount += count;
+        m_dirty = true;
+    }
+    return ok;
 }
 
-void Control::processMsg(struct msg_struct *msg, struct reply_struct *reply)
+// False for unknown messages, the client can't be understood anymore
+bool Control::processMsg(ControlClient &client, uint32_t type, const union msg_payload *msg, struct reply_struct *reply)
 {
-    reply->msgtype = msg->type;
+    reply->msgtype = type;
 
-    switch (msg->type) {
+    switch (type) {
     case MSG_CREATE_IMAGE:
-        processCreateImageMsg(msg, reply);
+        processCreateImageMsg(client, &msg->create_image, reply);
         break;
     case MSG_UPDATE_IMAGE:
-        processUpdateImageMsg(msg, reply);
+        processUpdateImageMsg(client, &msg->update_image, reply);
         break;
     case MSG_UPDATE_IMAGE_CONTENTS:
-        processUpdateImageContentsMsg(msg, reply);
+        processUpdateImageContentsMsg(client, &msg->update_image_contents, reply);
         break;
     case MSG_DESTROY_IMAGE:
-        processDestroyImageMsg(msg, reply);
+        processDestroyImageMsg(client, &msg->destroy_image, reply);
         break;
     case MSG_DESTROY_ALL_IMAGES:
-        processDestroyAllImagesMsg(msg, reply);
+        processDestroyAllImagesMsg(client, reply);
+        break;
+    case MSG_CREATE_RING:
+        processCreateRingMsg(client, &msg->create_ring, reply);
         break;
     default:
-        std::cerr << "Invalid msg type " << msg->type << std::endl;
+        std::cerr << "Invalid msg type " << type << std::endl;
         reply->status = STATUS_ERROR;
-        break;
+        return false;
     }
+    return true;
 }
 
-void Control::processCreateImageMsg(struct msg_struct *msg, struct reply_struct *reply)
+void Control::processCreateImageMsg(ControlClient &client, const struct msg_create_image *m, struct reply_struct *reply)
 {
-    struct msg_create_image *m = &msg->create_image;
-
     reply->id = m->id;
 
-    if (m->width == 0 || m->height == 0) {
+    // Take the fds first, so they are consumed (and closed) even on error
+    // With ring, fds were sent on the socket before the message
+    if (client.ring && client.recvFds.size() < m->nfd) {
+        receiveSocket(client);
+    }
+    const size_t nfd = std::min<size_t>(m->nfd, client.recvFds.size());
+    std::vector<int> fds(client.recvFds.begin(), client.recvFds.begin() + nfd);
+    client.recvFds.erase(client.recvFds.begin(), client.recvFds.begin() + nfd);
+
+    createImage(client, m, fds, reply);
+
+    // Left over when the image wasn't created
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+void Control::createImage(ControlClient &client, const struct msg_create_image *m, std::vector<int> &fds, struct reply_struct *reply)
+{
+
+    if (m->width == 0 || m->height == 0 || m->width > MAX_IMAGE_DIMENSION || m->height > MAX_IMAGE_DIMENSION) {
         std::cerr << "Invalid size: " << m->width << "x" << m->height << std::endl;
         reply->status = STATUS_ERROR;
         return;
     }
 
-    if (m->memsize > 0 && (m->memsize > MAX_MEM_SIZE || m->memsize != (PIXELS_SIZE(m->width, m->height) * 2))) {
+    const int nbuffers = m->nbuffers ? m->nbuffers : 2;
+    if (m->memsize > 0 && nbuffers > MAX_SHM_BUFFERS) {
+        std::cerr << "Invalid buffer count: " << nbuffers << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    if (m->memsize > 0 && shm_format_bpp(m->shm_format) == 0) {
+        std::cerr << "Invalid shm format: " << (unsigned)m->shm_format << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    // memfd may be rounded up to its page size, eg. with hugepages
+    const uint64_t pixels_size = PIXELS_SIZE(m->width, m->height, m->shm_format) * nbuffers;
+    if (m->memsize > 0 && (m->memsize > m_maxImageMem || pixels_size > m_maxImageMem || m->memsize < pixels_size)) {
         std::cerr << "Invalid memsize: " << m->memsize << std::endl;
         reply->status = STATUS_ERROR;
         return;
     }
 
-    auto it = m_images.find(m->id);
+    if (m->memsize > 0 && m_totalMem + m->memsize > m_maxTotalMem) {
+        std::cerr << "Memory limit reached " << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    auto it = m_images.find(OVERLAY_IMAGE_KEY(client.id, m->id));
     if (it != m_images.end()) {
         std::cerr << "Already have image with id " << m->id << std::endl;
         reply->status = STATUS_ERROR;
         return;
     }
 
-    if (m_images.size() >= MAX_OVERLAY_COUNT) {
+    if (m_images.size() >= m_maxImages) {
         std::cerr << "Overlay count limit reached " << std::endl;
         reply->status = STATUS_ERROR;
         return;
     }
 
+    if (m->nfd < 1 || m->nfd > MSG_MAX_FDS || (m->memsize > 0 && m->nfd != 1) || fds.size() < m->nfd) {
+        std::cerr << "Invalid fd count " << (unsigned)m->nfd << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    // Mapped by us and imported by renderers, it must not shrink under them
+    if (m->memsize > 0 && !check_memfd(fds[0], m->memsize)) {
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
 #ifndef NDEBUG
     std::cout << "::Create image " << (unsigned)m->id << std::endl;
 #endif
@@ -259,28 +670,49 @@ void Control::processCreateImageMsg(struct msg_struct *msg, struct reply_struct
     img.height = m->height;
     img.visible = m->visible == 1;
     img.flip = m->flip;
+    img.premultiplied = m->premultiplied;
     img.dmabuf = m->memsize == 0;
     img.memsize = m->memsize;
+    img.nbuffers = m->memsize > 0 ? nbuffers : 0;
+    img.shmFormat = m->shm_format;
     img.format = m->format;
     img.modifier = m->modifier;
     memcpy(img.strides, m->strides, sizeof(m->strides));
     memcpy(img.offsets, m->offsets, sizeof(m->offsets));
     img.nfd = m->nfd;
-    m_images.insert({m->id, img});
+    for (int i = 0; i < img.nfd; ++i) {
+        img.dmabufs[i] = fds[i];
+    }
+    fds.clear();
+
+    if (!img.dmabuf) {
+        img.memory = std::make_shared<OverlayMemory>();
+        img.memory->fd = img.dmabufs[0];
+        img.memory->size = img.memsize;
+        m_totalMem += img.memsize;
+        img.dmabufs[0] = -1;
+        // Shared writable mapping can be imported by renderers as host memory
+        void *data = mmap(NULL, img.memsize, PROT_READ | PROT_WRITE, MAP_SHARED, img.memory->fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "mmap error: " << strerror(errno) << std::endl;
+            destroyImage(img);
+            reply->status = STATUS_ERROR;
+            return;
+        }
+        img.memory->data = data;
+    }
 
-    m_waitingId = m->id;
-    m_waitingForFd = true;
+    m_images.insert({OVERLAY_IMAGE_KEY(client.id, m->id), img});
+    m_generation++;
 
     reply->status = STATUS_OK;
 }
 
-void Control::processUpdateImageMsg(struct msg_struct *msg, struct reply_struct *reply)
+void Control::processUpdateImageMsg(ControlClient &client, const struct msg_update_image *m, struct reply_struct *reply)
 {
-    struct msg_update_image *m = &msg->update_image;
-
     reply->id = m->id;
 
-    auto it = m_images.find(m->id);
+    auto it = m_images.find(OVERLAY_IMAGE_KEY(client.id, m->id));
     if (it == m_images.end()) {
         std::cerr << "Unknown id " << m->id << std::endl;
         reply->status = STATUS_ERROR;
@@ -294,42 +726,100 @@ void Control::processUpdateImageMsg(struct msg_struct *msg, struct reply_struct
     it->second.x = m->x;
     it->second.y = m->y;
     it->second.visible = m->visible;
+    m_generation++;
 
     reply->status = STATUS_OK;
 }
 
-void Control::processUpdateImageContentsMsg(struct msg_struct *msg, struct reply_struct *reply)
+void Control::processUpdateImageContentsMsg(ControlClient &client, const struct msg_update_image_contents *m, struct reply_struct *reply)
 {
-    struct msg_update_image_contents *m = &msg->update_image_contents;
-
     reply->id = m->id;
 
-    auto it = m_images.find(m->id);
+    // Take the fence first, so it is consumed (and closed) even on error
+    std::shared_ptr<OverlayFence> fence;
+    if (m->acquire_fence) {
+        if (client.ring && client.recvFds.empty()) {
+            receiveSocket(client);
+        }
+        if (client.recvFds.empty()) {
+            std::cerr << "Invalid fd count 0" << std::endl;
+            reply->status = STATUS_ERROR;
+            return;
+        }
+        fence = std::make_shared<OverlayFence>();
+        fence->fd = client.recvFds.front();
+        client.recvFds.erase(client.recvFds.begin());
+    }
+
+    auto it = m_images.find(OVERLAY_IMAGE_KEY(client.id, m->id));
     if (it == m_images.end()) {
         std::cerr << "Unknown id " << m->id << std::endl;
         reply->status = STATUS_ERROR;
         return;
     }
 
-    if (m->buffer < 0 || m->buffer > 1) {
-        std::cerr << "Invalid buffer id " << m->buffer << std::endl;
+    OverlayImage &img = it->second;
+    if (img.dmabuf) {
+        if (m->seq && m->seq <= img.seq) {
+            std::cerr << "Invalid frame sequence " << m->seq << std::endl;
+            reply->status = STATUS_ERROR;
+            return;
+        }
+        img.seq = m->seq;
+        img.serial++;
+        img.acquireFence = fence;
+        reply->status = STATUS_OK;
+        reply->seq = img.seq;
+        return;
+    }
+
+    if (m->buffer >= img.nbuffers) {
+        std::cerr << "Invalid buffer id " << (unsigned)m->buffer << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    // Frames may only move forward, older buffers are released by the reply
+    if (m->seq && m->seq <= img.seq) {
+        std::cerr << "Invalid frame sequence " << m->seq << std::endl;
         reply->status = STATUS_ERROR;
         return;
     }
 
-    it->second.pixels = static_cast<uint8_t*>(it->second.memory) + (PIXELS_SIZE(it->second.width, it->second.height) * m->buffer);
+    img.pixels = static_cast<uint8_t*>(img.memory->data) + (PIXELS_SIZE(img.width, img.height, img.shmFormat) * m->buffer);
+    img.seq = m->seq;
+    img.serial++;
+    img.acquireFence = fence;
+
+    OverlayDamage &damage = img.damage[img.serial % MAX_DAMAGE_HISTORY];
+    damage.full = m->ndamage == 0 || m->ndamage > MAX_DAMAGE_RECTS;
+    damage.count = 0;
+    for (int i = 0; !damage.full && i < m->ndamage; ++i) {
+        // Clip to image
+        const int x1 = std::min<int>(m->damage[i].x, img.width);
+        const int y1 = std::min<int>(m->damage[i].y, img.height);
+        const int x2 = std::min<int>(m->damage[i].x + m->damage[i].width, img.width);
+        const int y2 = std::min<int>(m->damage[i].y + m->damage[i].height, img.height);
+        if (x2 <= x1 || y2 <= y1) {
+            continue;
+        }
+        OverlayRect &rect = damage.rects[damage.count++];
+        rect.x = x1;
+        rect.y = y1;
+        rect.width = x2 - x1;
+        rect.height = y2 - y1;
+    }
 
     reply->status = STATUS_OK;
     reply->buffer = m->buffer;
+    reply->seq = img.seq;
 }
 
-void Control::processDestroyImageMsg(struct msg_struct *msg, struct reply_struct *reply)
+void Control::processDestroyImageMsg(ControlClient &client, const struct msg_destroy_image *m, struct reply_struct *reply)
 {
-    struct msg_destroy_image *m = &msg->destroy_image;
-
     reply->id = m->id;
 
-    auto it = m_images.find(m->id);
+    auto it = m_images.find(OVERLAY_IMAGE_KEY(client.id, m->id));
     if (it == m_images.end()) {
         std::cerr << "Unknown id " << m->id << std::endl;
         reply->status = STATUS_ERROR;
@@ -340,58 +830,134 @@ void Control::processDestroyImageMsg(struct msg_struct *msg, struct reply_struct
     std::cout << "::Destroy image " << (unsigned)m->id << std::endl;
 #endif
 
-    destroyImage(it->second);
+    retireImage(it->second);
     m_images.erase(it);
 
     reply->status = STATUS_OK;
 }
 
-void Control::processDestroyAllImagesMsg(struct msg_struct *msg, struct reply_struct *reply)
+void Control::processDestroyAllImagesMsg(ControlClient &client, struct reply_struct *reply)
 {
 #ifndef NDEBUG
     std::cout << "::Destroy all images " << std::endl;
 #endif
 
-    destroyAllImages();
+    destroyAllImages(client);
 
     reply->status = STATUS_OK;
 }
 
-void Control::init()
+void Control::processCreateRingMsg(ControlClient &client, const struct msg_create_ring *m, struct reply_struct *reply)
 {
-    if (m_init) {
+    if (client.ring) {
+        std::cerr << "Ring already created" << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    if (client.recvFds.empty()) {
+        std::cerr << "Invalid fd count 0" << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    int fd = client.recvFds.front();
+    client.recvFds.erase(client.recvFds.begin());
+
+    const size_t size = m->memsize - sizeof(struct ring_header);
+    if (m->memsize <= sizeof(struct ring_header) || size > MAX_RING_SIZE || (size & (size - 1))) {
+        std::cerr << "Invalid ring memsize: " << m->memsize << std::endl;
+        close(fd);
+        reply->status = STATUS_ERROR;
         return;
     }
-    m_init = true;
 
+    if (!check_memfd(fd, m->memsize)) {
+        close(fd);
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    void *memory = mmap(NULL, m->memsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        std::cerr << "mmap error: " << strerror(errno) << std::endl;
+        reply->status = STATUS_ERROR;
+        return;
+    }
+
+    client.ring = static_cast<struct ring_header*>(memory);
+    client.ringData = static_cast<uint8_t*>(memory) + sizeof(struct ring_header);
+    client.ringMemsize = m->memsize;
+    client.ringSize = size;
+    client.ringTail = __atomic_load_n(&client.ring->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&client.ring->tail, client.ringTail, __ATOMIC_RELEASE);
+
+    reply->status = STATUS_OK;
+}
+
+void Control::init()
+{
     unlink(m_socketPath.c_str());
-    m_server = os_socket_listen_abstract(m_socketPath.c_str(), 1);
+    m_server = os_socket_listen_abstract(m_socketPath.c_str(), MAX_CLIENT_COUNT);
     if (m_server < 0) {
         std::cerr << "Couldn't create socket at " << m_socketPath << ": " << strerror(errno) << std::endl;
         return;
     }
     os_socket_block(m_server, false);
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_epoll < 0 || m_event < 0) {
+        std::cerr << "Couldn't create epoll: " << strerror(errno) << std::endl;
+        os_socket_close(m_server);
+        m_server = -1;
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = EPOLL_SERVER_ID;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_server, &ev);
+    ev.data.u32 = EPOLL_EVENT_ID;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_event, &ev);
+
+    m_thread = std::thread(&Control::run, this);
 }
 
-void Control::closeClient()
+void Control::closeClient(ControlClient &client)
 {
-    os_socket_close(m_client);
-    m_client = -1;
-    m_waitingForFd = false;
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, client.fd, NULL);
+    os_socket_close(client.fd);
+    client.fd = -1;
+    client.recvBuffer.clear();
+    for (int fd : client.recvFds) {
+        close(fd);
+    }
+    client.recvFds.clear();
+
+    destroyRing(client);
+    destroyAllImages(client);
+    m_dirty = true;
+}
 
-    destroyAllImages();
+void Control::destroyRing(ControlClient &client)
+{
+    if (client.ring) {
+        munmap(client.ring, client.ringMemsize);
+        client.ring = nullptr;
+        client.ringData = nullptr;
+        client.ringMemsize = 0;
+    }
 }
 
 void Control::destroyImage(OverlayImage &img)
 {
     if (img.memory) {
-        munmap(img.memory, img.memsize);
-        img.memory = nullptr;
-    }
-    if (img.memfd >= 0) {
-        close(img.memfd);
-        img.memfd = -1;
+        m_totalMem -= img.memsize;
     }
+    img.memory.reset();
     if (img.dmabuf) {
         for (int i = 0; i < img.nfd; ++i) {
             close(img.dmabufs[i]);
@@ -399,10 +965,22 @@ void Control::destroyImage(OverlayImage &img)
     }
 }
 
-void Control::destroyAllImages()
+void Control::retireImage(OverlayImage &img)
+{
+    // Destroyed once no snapshot references it
+    m_destroyedImages.push_back(img);
+    m_generation++;
+    m_dirty = true;
+}
+
+void Control::destroyAllImages(const ControlClient &client)
 {
-    for (auto it : m_images) {
-        destroyImage(it.second);
+    for (auto it = m_images.begin(); it != m_images.end();) {
+        if (OVERLAY_IMAGE_CLIENT(it->first) == client.id) {
+            retireImage(it->second);
+            it = m_images.erase(it);
+        } else {
+            ++it;
+        }
     }
-    m_images.clear();
 }
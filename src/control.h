@@ -2,10 +2,60 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
-#define MAX_OVERLAY_COUNT 16
+#include "control_prot.h"
+
+#define MAX_DAMAGE_HISTORY 4
+#define MAX_CLIENT_COUNT 8
+
+// Images are keyed by client id and the id client chose for the image
+#define OVERLAY_IMAGE_KEY(client, id) (((uint32_t)(client) << 8) | (uint8_t)(id))
+#define OVERLAY_IMAGE_CLIENT(key) ((uint32_t)(key) >> 8)
+
+struct OverlayRect
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+struct OverlayDamage
+{
+    bool full = true;
+    int count = 0;
+    OverlayRect rects[MAX_DAMAGE_RECTS];
+};
+
+// Client shared memory, unmapped when the last reference is gone. Renderers
+// may keep a reference while they use the mapping as imported host memory.
+struct OverlayMemory
+{
+    int fd = -1;
+    void *data = nullptr;
+    size_t size = 0;
+
+    OverlayMemory() = default;
+    OverlayMemory(const OverlayMemory &) = delete;
+    OverlayMemory &operator=(const OverlayMemory &) = delete;
+    ~OverlayMemory();
+};
+
+// sync_file fd, closed when the last reference is gone
+struct OverlayFence
+{
+    int fd = -1;
+
+    OverlayFence() = default;
+    OverlayFence(const OverlayFence &) = delete;
+    OverlayFence &operator=(const OverlayFence &) = delete;
+    ~OverlayFence();
+};
 
 struct OverlayImage
 {
@@ -16,10 +66,15 @@ struct OverlayImage
     bool visible = false;
     bool dmabuf = false;
     bool flip = false;
+    bool premultiplied = false;
     // shmem
     uint8_t *pixels = nullptr;
-    int memfd = -1;
-    void *memory = nullptr;
+    int nbuffers = 0;
+    int shmFormat = SHM_FORMAT_RGBA8;
+    uint64_t seq = 0; // client frame sequence of pixels
+    uint64_t serial = 0; // incremented on every contents update
+    OverlayDamage damage[MAX_DAMAGE_HISTORY]; // indexed by serial % MAX_DAMAGE_HISTORY
+    std::shared_ptr<OverlayMemory> memory;
     size_t memsize = 0;
     // dmabuf
     int format = 0;
@@ -28,37 +83,128 @@ struct OverlayImage
     int offsets[4] = {0};
     int dmabufs[4] = {-1};
     int nfd = 0;
+    // explicit sync, renderers wait on acquireFence before reading contents
+    // of serial
+    std::shared_ptr<OverlayFence> acquireFence;
+
+    // Collects rects changed since contents serial `since`.
+    // Returns false if the whole image needs to be uploaded.
+    bool damageSince(uint64_t since, std::vector<OverlayRect> &rects) const;
+};
+
+// Immutable state published by the I/O thread
+struct ControlSnapshot
+{
+    // Keyed by OVERLAY_IMAGE_KEY
+    std::unordered_map<uint32_t, OverlayImage> images;
+    // Changes when images are created, destroyed, moved, shown or hidden,
+    // but not on contents updates
+    uint64_t generation = 0;
+
+    // Deferred until no reader can see this snapshot anymore
+    std::vector<OverlayImage> destroyed;
+    std::vector<std::pair<uint32_t, std::vector<char>>> replies;
+
+    // Readers holding this snapshot, eg. until GPU finished copying from it
+    mutable std::atomic<int> refs{0};
+    // Replaced by a newer one, the last release wakes the I/O thread
+    std::atomic<bool> retired{false};
+};
+
+struct ControlClient
+{
+    uint32_t id = 0;
+    int fd = -1;
+    std::vector<char> recvBuffer;
+    std::vector<int> recvFds;
+
+    // shared memory ring, client -> layer
+    struct ring_header *ring = nullptr;
+    uint8_t *ringData = nullptr;
+    size_t ringMemsize = 0;
+    uint32_t ringSize = 0;
+    uint32_t ringTail = 0;
+
+    // replies waiting for next publish
+    std::vector<char> replies;
+    uint32_t replyCount = 0;
 };
 
 class Control
 {
 public:
-    explicit Control(const std::string &socketPath);
+    // Memory limits are in bytes of client shm
+    explicit Control(const std::string &socketPath, size_t maxImageMem, size_t maxTotalMem, size_t maxImages);
     ~Control();
 
-    const std::unordered_map<uint8_t, OverlayImage> &images() const;
+    // Current snapshot, referenced until release(). Never blocks or makes
+    // syscalls (except starting the I/O thread on first call).
+    const ControlSnapshot *acquire();
+    void release(const ControlSnapshot *snapshot);
 
-    void processSocket();
+    // Generation of the current snapshot shifted left by one, the low bit
+    // set while any image is visible. A renderer that drew nothing for a
+    // value can skip frames without acquire() until it changes.
+    uint64_t state();
 
 private:
-    void processMsg(struct msg_struct *msg, struct reply_struct *reply);
-    void processCreateImageMsg(struct msg_struct *msg, struct reply_struct *reply);
-    void processUpdateImageMsg(struct msg_struct *msg, struct reply_struct *reply);
-    void processUpdateImageContentsMsg(struct msg_struct *msg, struct reply_struct *reply);
-    void processDestroyImageMsg(struct msg_struct *msg, struct reply_struct *reply);
-    void processDestroyAllImagesMsg(struct msg_struct *msg, struct reply_struct *reply);
+    void run();
+    void publish();
+    void reclaim(bool force);
+    void wakeup();
+    bool setNeedWakeup(bool wakeup);
+
+    void sendPendingReplies(ControlClient &client);
+
+    bool processMsgs(ControlClient &client);
+    bool processMsg(ControlClient &client, uint32_t type, const union msg_payload *msg, struct reply_struct *reply);
+    void processCreateImageMsg(ControlClient &client, const struct msg_create_image *m, struct reply_struct *reply);
+    void createImage(ControlClient &client, const struct msg_create_image *m, std::vector<int> &fds, struct reply_struct *reply);
+    void processUpdateImageMsg(ControlClient &client, const struct msg_update_image *m, struct reply_struct *reply);
+    void processUpdateImageContentsMsg(ControlClient &client, const struct msg_update_image_contents *m, struct reply_struct *reply);
+    void processDestroyImageMsg(ControlClient &client, const struct msg_destroy_image *m, struct reply_struct *reply);
+    void processDestroyAllImagesMsg(ControlClient &client, struct reply_struct *reply);
+    void processCreateRingMsg(ControlClient &client, const struct msg_create_ring *m, struct reply_struct *reply);
+
+    void acceptClients();
+    bool receiveSocket(ControlClient &client);
+    ssize_t receiveRing(ControlClient &client);
+    void destroyRing(ControlClient &client);
 
     void init();
-    void closeClient();
+    void closeClient(ControlClient &client);
     void destroyImage(OverlayImage &img);
-    void destroyAllImages();
+    void retireImage(OverlayImage &img);
+    void destroyAllImages(const ControlClient &client);
 
     std::string m_socketPath;
-    std::unordered_map<uint8_t, OverlayImage> m_images;
+    size_t m_maxImageMem;
+    size_t m_maxTotalMem;
+    size_t m_maxImages;
+    std::once_flag m_initFlag;
+    std::thread m_thread;
+
+    // shared with readers
+    std::atomic<ControlSnapshot*> m_snapshot;
+    std::atomic<uint64_t> m_state;
+    std::atomic<int> m_readers;
+    // Reclaim waits for m_readers, the last one leaving wakes the I/O thread
+    std::atomic<bool> m_reclaimPending;
+    std::atomic<bool> m_quit;
+
+    // owned by I/O thread
+    std::unordered_map<uint32_t, OverlayImage> m_images;
+    std::unordered_map<uint32_t, ControlClient> m_clients;
+    std::vector<uint32_t> m_closedClients;
+    std::vector<OverlayImage> m_destroyedImages;
+    std::vector<ControlSnapshot*> m_retired;
+    size_t m_totalMem = 0; // mapped shm, including images not reclaimed yet
+    bool m_dirty = false;
+    uint64_t m_generation = 0;
 
-    bool m_init = false;
-    int m_client = -1;
     int m_server = -1;
-    uint8_t m_waitingId = 0;
-    bool m_waitingForFd = false;
+    int m_epoll = -1;
+    int m_event = -1;
+    uint32_t m_lastClientId = 0;
+    std::vector<char> m_discardBuffer;
 };
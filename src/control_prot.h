@@ -7,15 +7,45 @@
 #include <sys/socket.h>
 #include <linux/memfd.h>
 
-#define MSG_BUF_SIZE 128 // XXX
-#define REPLY_BUF_SIZE 16
-#define PIXELS_SIZE(w, h) ((w) * (h) * sizeof(uint32_t))
+#define MSG_MAX_SIZE 4096
+#define MSG_MAX_FDS 4
+#define PIXELS_SIZE(w, h, format) ((uint64_t)(w) * (h) * shm_format_bpp(format))
+#define MAX_IMAGE_DIMENSION 16384
+#define MAX_DAMAGE_RECTS 8
+#define MAX_SHM_BUFFERS 8
+#define MAX_RING_SIZE (1024 * 1024)
 
 enum status {
     STATUS_OK = 0,
     STATUS_ERROR = 1,
 };
 
+// Pixel layout of shmem images, in memory byte order
+enum shm_format {
+    SHM_FORMAT_RGBA8           = 0, // R, G, B, A
+    SHM_FORMAT_BGRA8           = 1, // B, G, R, A (QImage::Format_ARGB32 on little endian)
+    SHM_FORMAT_RGB565          = 2, // native endian uint16, R in high bits, opaque
+    SHM_FORMAT_A8              = 3, // alpha only, white
+    SHM_FORMAT_L8              = 4, // luminance only, opaque
+};
+
+// Bytes per pixel, 0 for unknown format
+static inline uint32_t shm_format_bpp(uint32_t format)
+{
+    switch (format) {
+    case SHM_FORMAT_RGBA8:
+    case SHM_FORMAT_BGRA8:
+        return 4;
+    case SHM_FORMAT_RGB565:
+        return 2;
+    case SHM_FORMAT_A8:
+    case SHM_FORMAT_L8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 enum msg_type {
     MSG_INVALID                = 0xFFFFFFFF,
     MSG_CREATE_IMAGE           = 1,
@@ -23,6 +53,19 @@ enum msg_type {
     MSG_UPDATE_IMAGE_CONTENTS  = 3,
     MSG_DESTROY_IMAGE          = 4,
     MSG_DESTROY_ALL_IMAGES     = 5,
+    MSG_CREATE_RING            = 6,
+};
+
+// Every message is a msg_header followed by `size` bytes of payload.
+// Multiple messages can be sent in one write, the layer replies to all
+// messages it read at once with a single reply_header followed by `count`
+// reply_struct entries.
+// Payloads shorter than the struct are zero-extended and longer payloads
+// are truncated, so fields can be appended without breaking the framing.
+// File descriptors are sent as SCM_RIGHTS together with the message bytes.
+struct msg_header {
+    uint32_t type;
+    uint32_t size;
 };
 
 struct msg_create_image {
@@ -41,6 +84,12 @@ struct msg_create_image {
     uint64_t modifier;
     int32_t strides[4];
     int32_t offsets[4];
+    // shmem, number of buffers of PIXELS_SIZE in memfd (0 - 2 buffers)
+    uint8_t nbuffers;
+    // shmem, enum shm_format
+    uint8_t shm_format;
+    // color is premultiplied by alpha
+    uint8_t premultiplied;
 };
 
 struct msg_update_image {
@@ -50,23 +99,63 @@ struct msg_update_image {
     uint8_t visible;
 };
 
+struct msg_rect {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+};
+
+// Also valid for dmabuf images, buffer and damage are ignored for them.
 struct msg_update_image_contents {
     uint8_t id;
-    uint8_t buffer; // 0 - front, 1 - back
+    uint8_t buffer; // index of buffer in memfd, < nbuffers
+    uint8_t ndamage; // 0 - whole image changed
+    msg_rect damage[MAX_DAMAGE_RECTS];
+    // monotonically increasing frame sequence number
+    uint64_t seq;
+    // message carries one sync_file fd, layer waits on it before reading
+    uint8_t acquire_fence;
 };
 
 struct msg_destroy_image {
     uint8_t id;
 };
 
-struct msg_struct {
-    uint32_t type;
-    union {
-        msg_create_image create_image;
-        msg_update_image update_image;
-        msg_update_image_contents update_image_contents;
-        msg_destroy_image destroy_image;
-    };
+// Optional single producer single consumer ring in a memfd, sent with
+// MSG_CREATE_RING. Once the layer acks it, the client writes all messages
+// to the ring and the socket only carries replies and fds. Fds for a message
+// are sent on the socket (with one dummy byte) before the message is written
+// to the ring.
+// head/tail are free running byte offsets into the data following the
+// header, accessed with acquire/release atomics. Producer writes head,
+// consumer writes tail. Messages may wrap around the end of data.
+// Consumer sets need_wakeup before it goes to sleep, producer then has to
+// send one dummy byte on the socket after publishing head (seq_cst fence
+// between storing head and loading need_wakeup).
+struct ring_header {
+    uint32_t size; // size of data, power of two
+    uint32_t head;
+    uint8_t padding0[56];
+    uint32_t tail; // on its own cache line
+    uint32_t need_wakeup;
+    uint8_t padding1[56];
+};
+
+struct msg_create_ring {
+    uint32_t memsize; // sizeof(ring_header) + size
+};
+
+union msg_payload {
+    msg_create_image create_image;
+    msg_update_image update_image;
+    msg_update_image_contents update_image_contents;
+    msg_destroy_image destroy_image;
+    msg_create_ring create_ring;
+};
+
+struct reply_header {
+    uint32_t count;
 };
 
 struct reply_struct {
@@ -74,4 +163,7 @@ struct reply_struct {
     uint32_t msgtype;
     uint8_t id;
     uint8_t buffer;
+    // MSG_UPDATE_IMAGE_CONTENTS: the newest frame the layer acquired,
+    // all buffers with an older sequence number are free for reuse
+    uint64_t seq;
 };
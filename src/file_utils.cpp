@@ -8,6 +8,8 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cerrno>
+#include <cstdio>
 
 std::string read_line(const std::string& filename)
 {
@@ -172,3 +174,47 @@ std::string get_config_dir()
         path += "/.config";
     return path;
 }
+
+std::string get_cache_dir()
+{
+    const char* p = getenv("XDG_CACHE_HOME");
+    if (p)
+        return p;
+
+    std::string path = get_home_dir();
+    if (!path.empty())
+        path += "/.cache";
+    return path;
+}
+
+bool read_file(const std::string& path, std::vector<char>& data)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    data.resize(file.tellg());
+    file.seekg(0);
+    return bool(file.read(data.data(), data.size()));
+}
+
+bool write_file(const std::string& path, const void* data, size_t size)
+{
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file || !file.write(static_cast<const char*>(data), size))
+            return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool create_dirs(const std::string& path)
+{
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        const std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+            return false;
+        if (pos == std::string::npos)
+            return true;
+    }
+}
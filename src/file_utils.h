@@ -22,3 +22,8 @@ bool get_wine_exe_name(std::string& name, bool keep_ext = false);
 std::string get_home_dir();
 std::string get_data_dir();
 std::string get_config_dir();
+std::string get_cache_dir();
+bool read_file(const std::string& path, std::vector<char>& data);
+// Written to a temporary file first, readers never see partial contents
+bool write_file(const std::string& path, const void* data, size_t size);
+bool create_dirs(const std::string& path);
@@ -21,6 +21,9 @@ static void *(*pfn_eglGetCurrentDisplay)() = nullptr;
 static void *(*pfn_eglCreateImage)(void*, void*, unsigned, void*, const intptr_t*) = nullptr;
 static int (*pfn_eglDestroyImage)(void*, void*) = nullptr;
 static void (*pfn_glEGLImageTargetTexture2DOES)(unsigned, void*) = nullptr;
+static void *(*pfn_eglCreateSync)(void*, unsigned, const intptr_t*) = nullptr;
+static unsigned (*pfn_eglWaitSync)(void*, void*, int) = nullptr;
+static unsigned (*pfn_eglDestroySync)(void*, void*) = nullptr;
 
 static bool init_proc_egl()
 {
@@ -37,6 +40,22 @@ static bool init_proc_egl()
     return true;
 }
 
+// EGL_ANDROID_native_fence_sync, for explicit sync with clients
+static bool init_proc_egl_sync()
+{
+#define GET_PROC(x) \
+    if (!pfn_##x) { \
+        pfn_##x = reinterpret_cast<decltype(pfn_##x)>(get_egl_proc_address(#x)); \
+        if (!pfn_##x) return false; \
+    }
+    GET_PROC(eglGetCurrentDisplay);
+    GET_PROC(eglCreateSync);
+    GET_PROC(eglWaitSync);
+    GET_PROC(eglDestroySync);
+#undef GET_PROC
+    return true;
+}
+
 namespace imgoverlay { namespace GL {
 
 struct GLVec
@@ -69,10 +88,14 @@ struct state {
 
     struct image_data {
         GLuint texture = 0;
-        uint8_t *uploaded_pixels = nullptr;
+        uint64_t uploaded_serial = 0;
+        uint64_t fence_serial = 0; // serial whose acquire fence was waited on
         void *image = nullptr;
     };
-    std::unordered_map<uint8_t, image_data> images_data;
+    std::unordered_map<uint32_t, image_data> images_data;
+    std::vector<OverlayRect> damage_rects;
+    // Control::state() of the last frame that drew nothing
+    uint64_t idle_state = UINT64_MAX;
 };
 
 std::mutex mutex;
@@ -93,7 +116,10 @@ void imgui_init()
     if (!is_blacklisted(true)) {
         std::cout << "imgoverlay " << IMGOVERLAY_VERSION << std::endl;
         parse_overlay_config(&params, getenv("IMGOVERLAY_CONFIG"));
-        state.control = new Control(params.socket);
+        state.control = new Control(params.socket,
+                                    size_t(params.max_image_mem) * 1024 * 1024,
+                                    size_t(params.max_total_mem) * 1024 * 1024,
+                                    params.max_overlays);
     }
 }
 
@@ -255,18 +281,70 @@ static GLuint create_dmabuf_texture(const OverlayImage &img, void *&image)
     }
 }
 
-static GLuint create_update_texture(GLuint texture, int width, int height, uint8_t *pixels)
+struct gl_format {
+    GLint internal_format;
+    GLenum format;
+    GLenum type;
+    GLint swizzle[4];
+};
+
+// Channel order is fixed up with texture swizzle, so GLES needs no BGRA extension
+static gl_format shm_format_to_gl(int format)
+{
+    switch (format) {
+    case SHM_FORMAT_BGRA8:
+        return { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, { GL_BLUE, GL_GREEN, GL_RED, GL_ALPHA } };
+    case SHM_FORMAT_RGB565:
+        return { GL_RGB565, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, { GL_RED, GL_GREEN, GL_BLUE, GL_ONE } };
+    case SHM_FORMAT_A8:
+        return { GL_R8, GL_RED, GL_UNSIGNED_BYTE, { GL_ONE, GL_ONE, GL_ONE, GL_RED } };
+    case SHM_FORMAT_L8:
+        return { GL_R8, GL_RED, GL_UNSIGNED_BYTE, { GL_RED, GL_RED, GL_RED, GL_ONE } };
+    default:
+        return { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA } };
+    }
+}
+
+static GLuint create_update_texture(GLuint texture, int width, int height, int shm_format, uint8_t *pixels, const std::vector<OverlayRect> *damage)
 {
-    if (texture > 0) {
+    const gl_format fmt = shm_format_to_gl(shm_format);
+
+    // Rows of 1 and 2 byte formats are not 4 byte aligned
+    GLint last_alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &last_alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (texture > 0 && damage) {
+        GLint last_row_length, last_skip_pixels, last_skip_rows;
+        glGetIntegerv(GL_UNPACK_ROW_LENGTH, &last_row_length);
+        glGetIntegerv(GL_UNPACK_SKIP_PIXELS, &last_skip_pixels);
+        glGetIntegerv(GL_UNPACK_SKIP_ROWS, &last_skip_rows);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+        for (const OverlayRect &rect : *damage) {
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect.x);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, rect.y);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width, rect.height, fmt.format, fmt.type, pixels);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, last_row_length);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, last_skip_pixels);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, last_skip_rows);
+    } else if (texture > 0) {
         glBindTexture(GL_TEXTURE_2D, texture);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, fmt.format, fmt.type, pixels);
     } else {
         glGenTextures(1, &texture);
         glBindTexture(GL_TEXTURE_2D, texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glTexImage2D(GL_TEXTURE_2D, 0, fmt.internal_format, width, height, 0, fmt.format, fmt.type, pixels);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, fmt.swizzle[0]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, fmt.swizzle[1]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, fmt.swizzle[2]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, fmt.swizzle[3]);
     }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, last_alignment);
     return texture;
 }
 
@@ -291,13 +369,13 @@ static void destroy_texture(GLuint texture, void *image)
     glDeleteTextures(1, &texture);
 }
 
-static void update_images()
+static void update_images(const ControlSnapshot *snapshot)
 {
-    const std::unordered_map<uint8_t, OverlayImage> &images = state.control->images();
+    const std::unordered_map<uint32_t, OverlayImage> &images = snapshot->images;
 
     // Created
-    for (auto it : images) {
-        const uint8_t id = it.first;
+    for (const auto &it : images) {
+        const uint32_t id = it.first;
         if (state.images_data.find(id) != state.images_data.end()) {
             continue;
         }
@@ -309,51 +387,101 @@ static void update_images()
     }
 
     // Destroyed
-    std::vector<uint8_t> to_erase;
+    std::vector<uint32_t> to_erase;
     for (auto it : state.images_data) {
-        const uint8_t id = it.first;
+        const uint32_t id = it.first;
         if (images.find(id) != images.end()) {
             continue;
         }
         destroy_texture(it.second.texture, it.second.image);
         to_erase.push_back(id);
     }
-    for (uint8_t id : to_erase) {
+    for (uint32_t id : to_erase) {
         state.images_data.erase(id);
     }
 
     // Updated
-    for (auto it : images) {
-        const uint8_t id = it.first;
+    for (const auto &it : images) {
+        const uint32_t id = it.first;
         const OverlayImage &img = it.second;
         state::image_data &img_data = state.images_data[id];
-        if (img.dmabuf || img.pixels == img_data.uploaded_pixels) {
+        if (img.dmabuf || !img.pixels || img.serial == img_data.uploaded_serial) {
+            continue;
+        }
+        // Hidden images are brought up to date once they are shown again
+        if (!img.visible || params.no_display) {
+            continue;
+        }
+        const bool partial = img_data.texture > 0 && img.damageSince(img_data.uploaded_serial, state.damage_rects);
+        img_data.uploaded_serial = img.serial;
+        if (partial && state.damage_rects.empty()) {
+            continue;
+        }
+        img_data.texture = create_update_texture(img_data.texture, img.width, img.height, img.shmFormat, img.pixels, partial ? &state.damage_rects : nullptr);
+    }
+}
+
+static void wait_acquire_fences(const ControlSnapshot *snapshot)
+{
+    if (state.glx || params.no_display || !init_proc_egl_sync()) {
+        return;
+    }
+
+    void *dpy = pfn_eglGetCurrentDisplay();
+    for (const auto &it : snapshot->images) {
+        const OverlayImage &img = it.second;
+        state::image_data &img_data = state.images_data[it.first];
+        if (!img.visible) {
+            continue;
+        }
+        if (!img.acquireFence || img_data.fence_serial == img.serial) {
+            continue;
+        }
+        img_data.fence_serial = img.serial;
+
+        // Sync takes ownership of the fd, GPU waits before the overlay draws
+        const int fd = fcntl(img.acquireFence->fd, F_DUPFD_CLOEXEC, 0);
+        const intptr_t attribs[] = {
+            0x3145, // EGL_SYNC_NATIVE_FENCE_FD_ANDROID
+            fd,
+            0x3038, // EGL_NONE
+        };
+        void *sync = fd >= 0 ? pfn_eglCreateSync(dpy, 0x3144 /*EGL_SYNC_NATIVE_FENCE_ANDROID*/, attribs) : nullptr;
+        if (!sync) {
+            std::cerr << "Failed to import acquire fence" << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
             continue;
         }
-        img_data.texture = create_update_texture(img_data.texture, img.width, img.height, img.pixels);
-        img_data.uploaded_pixels = img.pixels;
+        pfn_eglWaitSync(dpy, sync, 0);
+        pfn_eglDestroySync(dpy, sync);
     }
 }
 
+static void premultiplied_blend(const ImDrawList *, const ImDrawCmd *)
+{
+    glBlendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+}
+
 static void render_imgui()
 {
-    state.control->processSocket();
-    check_keybinds(params);
+    const ControlSnapshot *snapshot = state.control->acquire();
 
-    update_images();
+    update_images(snapshot);
+    wait_acquire_fences(snapshot);
 
     ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0,0));
     ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0,0));
     ImGui::PushStyleVar(ImGuiStyleVar_WindowBorderSize, 0.0f);
 
-    const std::unordered_map<uint8_t, OverlayImage> &images = state.control->images();
+    const std::unordered_map<uint32_t, OverlayImage> &images = snapshot->images;
 
-    for (auto it : images) {
-        const uint8_t id = it.first;
+    for (const auto &it : images) {
+        const uint32_t id = it.first;
         const OverlayImage &img = it.second;
         state::image_data &img_data = state.images_data[id];
         if (!img.visible || params.no_display) {
-            img_data.uploaded_pixels = nullptr;
             continue;
         }
         if (!img.dmabuf && !img.pixels) {
@@ -362,18 +490,25 @@ static void render_imgui()
         ImGui::SetNextWindowBgAlpha(0.0);
         ImGui::SetNextWindowPos(ImVec2(img.x, img.y), ImGuiCond_Always);
         ImGui::SetNextWindowSize(ImVec2(img.width, img.height), ImGuiCond_Always);
-        char name[4];
-        snprintf(name, 4, "%u", (unsigned)id);
+        char name[16];
+        snprintf(name, sizeof(name), "%u", (unsigned)id);
         ImGui::Begin(name, &open, ImGuiWindowFlags_NoDecoration);
+        if (img.premultiplied) {
+            ImGui::GetWindowDrawList()->AddCallback(premultiplied_blend, nullptr);
+        }
         if (img.flip) {
             ImGui::Image((VkDescriptorSet)(uint64_t)img_data.texture, ImVec2(img.width, img.height), ImVec2(0, 1), ImVec2(1, 0));
         } else {
             ImGui::Image((VkDescriptorSet)(uint64_t)img_data.texture, ImVec2(img.width, img.height));
         }
+        if (img.premultiplied) {
+            ImGui::GetWindowDrawList()->AddCallback(ImDrawCallback_ResetRenderState, nullptr);
+        }
         ImGui::End();
     }
 
     ImGui::PopStyleVar(3);
+    state.control->release(snapshot);
 }
 
 void imgui_render(unsigned int width, unsigned int height)
@@ -381,6 +516,13 @@ void imgui_render(unsigned int width, unsigned int height)
     if (!state.imgui_ctx)
         return;
 
+    // Nothing shown and textures of destroyed images already gone, the GL
+    // state isn't even touched
+    check_keybinds(params);
+    const uint64_t control_state = state.control->state();
+    if (params.no_display || control_state == state.idle_state)
+        return;
+
     ImGuiContext *saved_ctx = ImGui::GetCurrentContext();
     ImGui::SetCurrentContext(state.imgui_ctx);
     ImGui::GetIO().DisplaySize = ImVec2(width, height);
@@ -395,6 +537,8 @@ void imgui_render(unsigned int width, unsigned int height)
     ImGui::Render();
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
     ImGui::SetCurrentContext(saved_ctx);
+    if (!(control_state & 1))
+        state.idle_state = control_state;
 }
 
 }} // namespaces
@@ -21,16 +21,23 @@
  * IN THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <thread>
+#include <atomic>
 #include <chrono>
 #include <unordered_map>
 #include <mutex>
 #include <vector>
 #include <list>
+#include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cmath>
 
 #include <vulkan/vulkan.h>
 #include <vulkan/vk_layer.h>
@@ -56,8 +63,6 @@
 #include "version.h"
 #include "control.h"
 
-static bool _open = false;
-
 /* Mapped from VkInstace/VkPhysicalDevice */
 struct instance_data {
    struct vk_instance_dispatch_table vtable;
@@ -66,6 +71,121 @@ struct instance_data {
    Control *control = nullptr;
 };
 
+/* Persistently mapped buffer shared by all swapchains of a device. Space
+ * is handed out in order and reclaimed from the tail as draws release it,
+ * once the GPU is done with it.
+ */
+struct overlay_ring {
+   struct overlay_ring_pool *pool;
+   VkBuffer buffer;
+   VkDeviceMemory mem;
+   uint8_t *map;
+   bool coherent;
+   VkDeviceSize size;
+   VkDeviceSize head, tail; // monotonic, offsets are modulo size
+   std::deque<std::pair<VkDeviceSize, bool>> allocs; // end and released, oldest first
+};
+
+struct overlay_ring_alloc {
+   struct overlay_ring *ring = nullptr;
+   VkDeviceSize offset = 0;
+   VkDeviceSize size = 0;
+   VkDeviceSize end = 0;
+};
+
+/* Current ring of one kind of data. A growing pool replaces a full ring
+ * with one twice the size, the old one is kept until all its space is
+ * released. Shared by swapchains presenting from any thread.
+ */
+struct overlay_ring_pool {
+   std::mutex mutex;
+   VkBufferUsageFlags usage;
+   VkDeviceSize size; // of the first ring
+   bool grow;
+   struct overlay_ring *ring = nullptr;
+   std::vector<struct overlay_ring *> retired;
+};
+
+#define OVERLAY_RING_SIZE (64 * 1024)
+/* Enough for about three frames of full 1080p RGBA uploads */
+#define OVERLAY_STAGING_RING_SIZE (32 * 1024 * 1024)
+
+/* Device memory overlay images are sub-allocated from. Linear and optimal
+ * resources get blocks of their own, bufferImageGranularity never matters.
+ */
+struct overlay_memory_block {
+   VkDeviceMemory mem;
+   VkDeviceSize size;
+   uint32_t type;
+   bool linear;
+   VkDeviceSize used;
+   std::map<VkDeviceSize, VkDeviceSize> free; // offset -> size
+};
+
+/* Dedicated when block is NULL: too big for a block or imported */
+struct overlay_allocation {
+   struct overlay_memory_block *block = nullptr;
+   VkDeviceMemory mem = VK_NULL_HANDLE;
+   VkDeviceSize offset = 0;
+   VkDeviceSize size = 0;
+};
+
+#define OVERLAY_MEMORY_BLOCK_SIZE (16 * 1024 * 1024)
+
+/* Workgroup size of overlay.comp */
+#define OVERLAY_TILE_SIZE 16
+
+/* Render pass and pipelines for one swapchain format, no render pass
+ * with dynamic rendering
+ */
+struct overlay_pipelines {
+   VkRenderPass render_pass;
+   VkPipeline pipeline;
+   /* Images with their own descriptor set */
+   VkPipeline image_pipeline;
+   VkPipeline image_pipeline_premultiplied;
+   /* Images in the bindless array, when device_data::bindless */
+   VkPipeline bindless_pipeline;
+   VkPipeline bindless_pipeline_premultiplied;
+};
+
+/* Sampled image with its descriptor, bindless_index when bindless */
+struct overlay_texture {
+   VkImage image = 0;
+   VkImageView image_view = 0;
+   struct overlay_allocation mem;
+   VkDescriptorSet desc = 0;
+   VkDescriptorPool desc_pool = 0;
+   uint32_t bindless_index = 0;
+   uint64_t uploaded_serial = 0;
+};
+
+/* GPU side of a control image, shared by all swapchains of a device */
+struct overlay_image {
+   struct overlay_texture tex; // sampled by draws
+   /* Async uploads copy to back while tex is sampled, the two swap
+    * once the copy finished
+    */
+   struct overlay_texture back;
+   uint64_t back_upload_value = 0; // upload_timeline value of a copy to back, 0 when none
+   uint64_t back_draw_value = 0; // draw_timeline value of the last draw sampling back
+   uint64_t tex_draw_value = 0; // same for tex
+   /* imported shm, used instead of staging copies when available */
+   VkBuffer host_buffer = 0;
+   VkDeviceMemory host_buffer_mem = 0;
+   std::shared_ptr<OverlayMemory> host_memory;
+   bool needs_layout = false;
+};
+
+/* Removed from the control snapshot while draws or uploads may still use it */
+struct overlay_retired_image {
+   struct overlay_image image;
+   uint64_t draw_value; // of device_data::draw_timeline once unused
+   uint64_t upload_value; // of device_data::upload_timeline once unused
+};
+
+struct overlay_upload;
+
 /* Mapped from VkDevice */
 struct device_data {
    struct instance_data *instance;
@@ -75,15 +195,142 @@ struct device_data {
    struct vk_device_dispatch_table vtable;
    PFN_vkGetImageMemoryRequirements2KHR GetImageMemoryRequirements2KHR;
    PFN_vkBindImageMemory2KHR BindImageMemory2KHR;
+#ifdef VK_KHR_dynamic_rendering
+   PFN_vkCmdBeginRenderingKHR CmdBeginRenderingKHR;
+   PFN_vkCmdEndRenderingKHR CmdEndRenderingKHR;
+   PFN_vkCmdPipelineBarrier2KHR CmdPipelineBarrier2KHR;
+#endif
 
    VkPhysicalDevice physical_device;
    VkDevice device;
 
    VkPhysicalDeviceProperties properties;
+   VkPhysicalDeviceMemoryProperties memory_properties;
+
+   /* Overlay images, shared by swapchains presenting from any thread */
+   std::mutex memory_mutex;
+   std::vector<struct overlay_memory_block *> memory_blocks;
+   struct {
+      uint32_t blocks;
+      VkDeviceSize block_size; // total of all blocks
+      uint32_t allocations; // sub-allocated and dedicated
+      VkDeviceSize allocated;
+      uint32_t dedicated;
+   } memory_stats = {};
+
+   /* VK_EXT_external_memory_host, shm is imported instead of copied */
+   bool external_memory_host = false;
+   VkDeviceSize min_imported_host_pointer_alignment = 0;
+
+   /* VK_KHR_external_semaphore_fd, explicit sync with clients */
+   bool external_semaphore_fd = false;
+
+   /* VK_EXT_descriptor_indexing, images sampled from one texture array */
+   bool descriptor_indexing = false;
+   uint32_t max_bindless_images = 0;
+
+   /* VK_KHR_dynamic_rendering and VK_KHR_synchronization2, the overlay
+    * pass needs no render pass and framebuffers. Only with headers that
+    * know them.
+    */
+   bool dynamic_rendering = false;
 
    struct queue_data *graphic_queue;
 
    std::vector<struct queue_data *> queues;
+
+   /* Queue of our own on a transfer only family, needs timeline
+    * semaphores. Shm uploads are submitted there so they don't sit in
+    * front of present on the graphics queue. VK_NULL_HANDLE otherwise.
+    */
+   VkQueue transfer_queue = VK_NULL_HANDLE;
+   uint32_t transfer_family = 0;
+   std::mutex transfer_mutex; // swapchains may present from any thread
+
+   /* Instance, vertex and index data of draws */
+   struct overlay_ring_pool vertex_rings;
+   /* Pixels of shm uploads, bounded */
+   struct overlay_ring_pool staging_rings;
+
+   /* Pipeline state shared by all swapchains, VK_NULL_HANDLE cache when
+    * the overlay isn't set up on this device
+    */
+   VkSampler font_sampler;
+   VkDescriptorSetLayout descriptor_layout;
+   VkPipelineLayout pipeline_layout;
+   VkShaderModule vert_module, frag_module;
+   bool bindless = false;
+   VkDescriptorSetLayout bindless_layout;
+   VkPipelineLayout bindless_pipeline_layout;
+   VkShaderModule bindless_vert_module, bindless_frag_module;
+   /* Compute composite into storage capable swapchain images, needs
+    * bindless images and unformatted storage image access
+    */
+   bool storage_without_format = false;
+   bool compute_composite = false;
+   VkDescriptorSetLayout compute_layout;
+   VkPipelineLayout compute_pipeline_layout;
+   VkShaderModule compute_module;
+   VkPipeline compute_pipeline;
+   /* Stages sampling overlay images, copies to them are made visible there */
+   VkPipelineStageFlags sample_stages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+   VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+
+   std::mutex pipelines_mutex;
+   std::unordered_map<VkFormat, struct overlay_pipelines *> pipelines;
+   /* Compiles common formats ahead of the first swapchain */
+   std::thread pipeline_thread;
+   std::atomic<bool> pipeline_thread_quit { false };
+
+   /* Overlay images, fonts and their uploads outlive swapchains, so
+    * recreating one or presenting to several windows imports and uploads
+    * nothing again. Swapchains hold images_mutex for a whole frame, which
+    * also keeps draw_value in submission order.
+    */
+   std::mutex images_mutex;
+   std::unordered_map<uint32_t, struct overlay_image> images;
+   /* Destroyed once the draws submitted before their removal finished,
+    * with their memory and bindless slots
+    */
+   std::list<struct overlay_retired_image> retired_images;
+
+   /* Grows by a pool twice the size of the last one when full */
+   std::vector<VkDescriptorPool> descriptor_pools;
+
+   /* VK_EXT_descriptor_indexing: one set with an array of all images.
+    * Images that find it full get descriptor sets of their own.
+    */
+   VkDescriptorPool bindless_pool;
+   VkDescriptorSet bindless_set;
+   uint32_t bindless_count = 0; // array elements
+   std::deque<uint32_t> bindless_free; // oldest freed first
+
+   bool font_uploaded = false;
+   VkImage font_image = VK_NULL_HANDLE;
+   VkImageView font_image_view;
+   struct overlay_allocation font_mem;
+   VkDescriptorSet font_desc;
+
+   /* Async uploads on transfer_queue */
+   VkCommandPool transfer_command_pool;
+   std::list<struct overlay_upload *> uploads;
+   VkSemaphore upload_timeline; // signaled by uploads
+   uint64_t upload_value = 0; // of the last submitted upload
+   VkSemaphore draw_timeline; // signaled by draws, uploads wait on it before overwriting back
+   uint64_t draw_value = 0; // of the last submitted draw
+   VkQueue draw_queue = VK_NULL_HANDLE; // the last draw was submitted to
+   uint64_t draw_wait_value = 0; // upload images without older contents wait for
+   bool draw_wait = false; // whether draw_wait_value wasn't reached yet
+   uint64_t texture_swaps = 0; // draws sampling swapped textures are recorded again
+
+   /* draw_timeline exists with timeline semaphores even without
+    * transfer_queue, it bounds the frames in flight of swapchains
+    */
+   bool timeline_semaphore = false;
+   /* Otherwise draw_value only numbers draws, those whose fence wasn't
+    * seen signaled yet
+    */
+   std::set<uint64_t> draws_pending;
 };
 
 /* Mapped from VkQueue */
@@ -95,21 +342,73 @@ struct queue_data {
    uint32_t family_index;
 };
 
+/* Sources of recorded copies. Uploads that don't fit the staging ring get
+ * buffers of their own.
+ */
+struct overlay_staging {
+   std::vector<struct overlay_ring_alloc> allocs;
+   std::vector<std::pair<VkBuffer, VkDeviceMemory>> buffers;
+};
+
 struct overlay_draw {
    VkCommandBuffer command_buffer;
+   /* Copies of this frame, submitted ahead of command_buffer */
+   VkCommandBuffer upload_command_buffer;
+
+   /* What command_buffer was recorded for, it is submitted again as long
+    * as they match. recorded_image is -1 when it can't be reused.
+    */
+   int recorded_image;
+   uint64_t recorded_generation;
+   uint64_t recorded_swaps;
+   uint32_t recorded_family;
 
    VkSemaphore cross_engine_semaphore;
 
+   /* Swapchain image and data of compute composite */
+   VkDescriptorSet compute_set;
+
    VkSemaphore semaphore;
    VkFence fence;
+   /* draw_value of the submit without timeline semaphores, 0 once fence
+    * was seen signaled
+    */
+   uint64_t value;
+
+   /* Held until fence signals, GPU may still copy from its shm buffers */
+   const ControlSnapshot *snapshot;
+
+   /* Client acquire fences imported for this submit */
+   std::vector<VkSemaphore> acquire_semaphores;
+
+   /* Instance, vertex and index data of command_buffer */
+   struct overlay_ring_alloc vertex_alloc;
+
+   /* Sources of the copies in upload_command_buffer, released once fence
+    * signals
+    */
+   struct overlay_staging staging;
+};
 
-   VkBuffer vertex_buffer;
-   VkDeviceMemory vertex_buffer_mem;
-   VkDeviceSize vertex_buffer_size;
+/* Copies submitted to device_data::transfer_queue */
+struct overlay_upload {
+   VkCommandBuffer command_buffer;
+   uint64_t value; // of device_data::upload_timeline once done
+   struct overlay_staging staging;
+};
+
+/* Per instance vertex data of an image quad, see overlay.vert */
+struct overlay_instance {
+   float rect[4]; // x, y, width, height
+   float uv[4];   // u0, v0, u1, v1
+   uint32_t color; // RGBA8, alpha is opacity
+   uint32_t texture; // bindless array element
+};
 
-   VkBuffer index_buffer;
-   VkDeviceMemory index_buffer_mem;
-   VkDeviceSize index_buffer_size;
+struct overlay_quad {
+   overlay_instance instance;
+   VkDescriptorSet desc;
+   bool premultiplied;
 };
 
 /* Mapped from VkSwapchainKHR */
@@ -124,70 +423,195 @@ struct swapchain_data {
    std::vector<VkImageView> image_views;
    std::vector<VkFramebuffer> framebuffers;
 
-   VkRenderPass render_pass;
+   /* Owned by device_data */
+   struct overlay_pipelines *pipelines;
 
-   VkDescriptorPool descriptor_pool;
-   VkDescriptorSetLayout descriptor_layout;
+   VkCommandPool command_pool;
 
-   VkSampler font_sampler;
+   /* Images have storage usage, frames without ImGui output are
+    * composited by overlay.comp
+    */
+   bool compute = false;
+   VkDescriptorPool compute_pool; // a set per draw
+   std::vector<bool> covered_tiles;
+   std::vector<uint32_t> tiles;
 
-   VkPipelineLayout pipeline_layout;
-   VkPipeline pipeline;
+   /* Least recently submitted first, at most one per image and a spare */
+   std::list<overlay_draw *> draws; /* List of struct overlay_draw */
+   struct {
+      uint32_t reused; // finished draw found
+      uint32_t allocated; // pool not full yet
+      uint32_t waited; // pool exhausted, waited for the oldest draw
+      uint32_t skipped; // pool exhausted, frame presented without overlay
+   } draw_stats = {};
+   /* draw_timeline values of draws that may not have finished, oldest first */
+   std::deque<uint64_t> draws_in_flight;
+
+   /* HUD content drawn through ImGui. Nothing builds any yet, so frames
+    * of image quads alone never touch ImGui.
+    */
+   bool hud = false;
 
-   VkCommandPool command_pool;
+   /* Control::state() of the last frame that drew nothing */
+   uint64_t idle_state = UINT64_MAX;
 
-   std::list<overlay_draw *> draws; /* List of struct overlay_draw */
+   /* Reused by every submit */
+   std::vector<VkSemaphore> submit_waits;
+   std::vector<VkPipelineStageFlags> submit_wait_stages;
+   std::vector<uint64_t> submit_wait_values;
 
-   bool font_uploaded;
-   VkImage font_image;
-   VkImageView font_image_view;
-   VkDeviceMemory font_mem;
-   VkBuffer upload_font_buffer;
-   VkDeviceMemory upload_font_buffer_mem;
-
-   struct image_data {
-       VkImage image = 0;
-       VkImageView image_view = 0;
-       VkDeviceMemory mem = 0;
-       VkBuffer upload_buffer = 0;
-       VkDeviceMemory upload_buffer_mem = 0;
-       VkDescriptorSet desc = 0;
-       void *upload_buffer_mem_map = nullptr;
-       uint8_t *uploaded_pixels = nullptr;
-       bool needs_layout = false;
-   };
-   std::unordered_map<uint8_t, image_data> images_data;
+   /* Serial of each image whose acquire fence this swapchain's draws
+    * waited on
+    */
+   std::unordered_map<uint32_t, uint64_t> fence_serials;
+   std::vector<OverlayRect> damage_rects;
+   const ControlSnapshot *snapshot = nullptr; // valid during before_present
+   std::vector<overlay_quad> quads; // visible images of the current frame
 
    /**/
    ImGuiContext* imgui_context;
 };
 
-// single global lock, for simplicity
-std::mutex global_lock;
+/* Objects to their data, looked up by every intercepted call. Open
+ * addressed so readers never lock: a slot's data is stored before its key
+ * and keys of live objects never move. Writers serialize on global_lock and
+ * replace the whole table when it is half full, including erased slots.
+ * Replaced tables are kept while readers may still probe them, until the
+ * last object, the instance, is unmapped.
+ */
+#define OBJECT_TABLE_EMPTY 0 // VK_NULL_HANDLE
+#define OBJECT_TABLE_ERASED UINT64_MAX
+
+struct object_slot {
+   std::atomic<uint64_t> key;
+   std::atomic<void *> data;
+};
+
+struct object_table {
+   size_t mask; // capacity - 1, a power of two
+   size_t used; // live and erased slots
+   struct object_slot *slots;
+};
+
+std::mutex global_lock; // writers only
 typedef std::lock_guard<std::mutex> scoped_lock;
-std::unordered_map<uint64_t, void *> vk_object_to_data;
+std::atomic<struct object_table *> vk_object_table { nullptr };
+std::vector<struct object_table *> retired_object_tables;
+size_t vk_object_count = 0;
 
 thread_local ImGuiContext* __MesaImGui;
 
 #define HKEY(obj) ((uint64_t)(obj))
 #define FIND(type, obj) (reinterpret_cast<type *>(find_object_data(HKEY(obj))))
 
+static size_t object_hash(uint64_t obj)
+{
+   /* Handles are mostly aligned pointers */
+   obj ^= obj >> 33;
+   obj *= 0xff51afd7ed558ccdull;
+   obj ^= obj >> 33;
+   return obj;
+}
+
 static void *find_object_data(uint64_t obj)
 {
-   scoped_lock lk(global_lock);
-   return vk_object_to_data[obj];
+   const struct object_table *table = vk_object_table.load(std::memory_order_acquire);
+   if (!table)
+      return NULL;
+   for (size_t i = object_hash(obj) & table->mask;; i = (i + 1) & table->mask) {
+      const uint64_t key = table->slots[i].key.load(std::memory_order_acquire);
+      if (key == obj)
+         return table->slots[i].data.load(std::memory_order_relaxed);
+      if (key == OBJECT_TABLE_EMPTY)
+         return NULL;
+   }
+}
+
+/* Slot of obj, or where to insert it. global_lock held */
+static struct object_slot *object_table_slot(struct object_table *table, uint64_t obj)
+{
+   struct object_slot *erased = NULL;
+   for (size_t i = object_hash(obj) & table->mask;; i = (i + 1) & table->mask) {
+      const uint64_t key = table->slots[i].key.load(std::memory_order_relaxed);
+      if (key == obj)
+         return &table->slots[i];
+      if (key == OBJECT_TABLE_ERASED && !erased)
+         erased = &table->slots[i];
+      if (key == OBJECT_TABLE_EMPTY)
+         return erased ? erased : &table->slots[i];
+   }
+}
+
+static struct object_table *create_object_table(size_t capacity)
+{
+   struct object_table *table = new object_table();
+   table->mask = capacity - 1;
+   table->used = 0;
+   table->slots = new object_slot[capacity];
+   for (size_t i = 0; i < capacity; i++) {
+      table->slots[i].key.store(OBJECT_TABLE_EMPTY, std::memory_order_relaxed);
+      table->slots[i].data.store(NULL, std::memory_order_relaxed);
+   }
+   return table;
 }
 
 static void map_object(uint64_t obj, void *data)
 {
    scoped_lock lk(global_lock);
-   vk_object_to_data[obj] = data;
+   struct object_table *table = vk_object_table.load(std::memory_order_relaxed);
+
+   /* Rebuilt at four times the live objects, erased slots are dropped */
+   if (!table || (table->used + 1) * 2 > table->mask + 1) {
+      size_t capacity = 64;
+      while (capacity < (vk_object_count + 1) * 4)
+         capacity *= 2;
+      struct object_table *new_table = create_object_table(capacity);
+      for (size_t i = 0; table && i <= table->mask; i++) {
+         const uint64_t key = table->slots[i].key.load(std::memory_order_relaxed);
+         if (key == OBJECT_TABLE_EMPTY || key == OBJECT_TABLE_ERASED)
+            continue;
+         struct object_slot *slot = object_table_slot(new_table, key);
+         slot->data.store(table->slots[i].data.load(std::memory_order_relaxed), std::memory_order_relaxed);
+         slot->key.store(key, std::memory_order_relaxed);
+         new_table->used++;
+      }
+      vk_object_table.store(new_table, std::memory_order_release);
+      if (table)
+         retired_object_tables.push_back(table);
+      table = new_table;
+   }
+
+   struct object_slot *slot = object_table_slot(table, obj);
+   const uint64_t key = slot->key.load(std::memory_order_relaxed);
+   if (key != obj) {
+      vk_object_count++;
+      if (key == OBJECT_TABLE_EMPTY)
+         table->used++;
+   }
+   slot->data.store(data, std::memory_order_relaxed);
+   slot->key.store(obj, std::memory_order_release);
 }
 
 static void unmap_object(uint64_t obj)
 {
    scoped_lock lk(global_lock);
-   vk_object_to_data.erase(obj);
+   struct object_table *table = vk_object_table.load(std::memory_order_relaxed);
+   if (!table)
+      return;
+   struct object_slot *slot = object_table_slot(table, obj);
+   if (slot->key.load(std::memory_order_relaxed) != obj)
+      return;
+   slot->key.store(OBJECT_TABLE_ERASED, std::memory_order_release);
+   vk_object_count--;
+
+   /* Nothing can be looked up anymore, no reader is left on old tables */
+   if (vk_object_count == 0) {
+      for (struct object_table *retired : retired_object_tables) {
+         delete[] retired->slots;
+         delete retired;
+      }
+      retired_object_tables.clear();
+   }
 }
 
 /**/
@@ -252,6 +676,71 @@ static VkLayerDeviceCreateInfo *get_device_chain_info(const VkDeviceCreateInfo *
    return NULL;
 }
 
+/* Size of the structs copy_feature_chain copies, 0 for others */
+static size_t feature_struct_size(VkStructureType sType)
+{
+   switch (sType) {
+   case VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO:
+      return sizeof(VkLayerDeviceCreateInfo);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2:
+      return sizeof(VkPhysicalDeviceFeatures2);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES:
+      return sizeof(VkPhysicalDeviceVulkan11Features);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES:
+      return sizeof(VkPhysicalDeviceVulkan12Features);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT:
+      return sizeof(VkPhysicalDeviceDescriptorIndexingFeaturesEXT);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR:
+      return sizeof(VkPhysicalDeviceTimelineSemaphoreFeaturesKHR);
+#ifdef VK_VERSION_1_3
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES:
+      return sizeof(VkPhysicalDeviceVulkan13Features);
+#endif
+#ifdef VK_KHR_dynamic_rendering
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR:
+      return sizeof(VkPhysicalDeviceDynamicRenderingFeaturesKHR);
+   case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR:
+      return sizeof(VkPhysicalDeviceSynchronization2FeaturesKHR);
+#endif
+   default:
+      return 0;
+   }
+}
+
+/* Replaces the structs of the app's const pNext chain in info, up to the
+ * last feature struct, with writable copies kept in copies. Fails when a
+ * struct of unknown size comes first, the chain is left as is then.
+ */
+static bool copy_feature_chain(VkDeviceCreateInfo &info,
+                               std::vector<std::unique_ptr<uint8_t[]>> &copies)
+{
+   const VkBaseInStructure *last = NULL;
+   for (const VkBaseInStructure *ext = (const VkBaseInStructure*)info.pNext; ext; ext = ext->pNext) {
+      if (ext->sType != VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO && feature_struct_size(ext->sType))
+         last = ext;
+   }
+   if (!last)
+      return true;
+   for (const VkBaseInStructure *ext = (const VkBaseInStructure*)info.pNext; ext != last->pNext; ext = ext->pNext) {
+      if (!feature_struct_size(ext->sType))
+         return false;
+   }
+
+   VkBaseOutStructure *prev = NULL;
+   for (const VkBaseInStructure *ext = (const VkBaseInStructure*)info.pNext; ext != last->pNext; ext = ext->pNext) {
+      const size_t size = feature_struct_size(ext->sType);
+      copies.emplace_back(new uint8_t[size]);
+      VkBaseOutStructure *copy = (VkBaseOutStructure*)copies.back().get();
+      memcpy(copy, ext, size);
+      if (prev)
+         prev->pNext = copy;
+      else
+         info.pNext = copy;
+      prev = copy;
+   }
+   return true;
+}
+
 /**/
 
 static struct instance_data *new_instance_data(VkInstance instance)
@@ -295,6 +784,14 @@ static struct device_data *new_device_data(VkDevice device, struct instance_data
    struct device_data *data = new device_data();
    data->instance = instance;
    data->device = device;
+   /* Storage for the instances and tiles of compute composite */
+   data->vertex_rings.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+   data->vertex_rings.size = OVERLAY_RING_SIZE;
+   data->vertex_rings.grow = true;
+   data->staging_rings.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+   data->staging_rings.size = OVERLAY_STAGING_RING_SIZE;
+   data->staging_rings.grow = false;
    map_object(HKEY(data->device), data);
    return data;
 }
@@ -387,24 +884,96 @@ static void destroy_swapchain_data(struct swapchain_data *data)
    delete data;
 }
 
-struct overlay_draw *get_overlay_draw(struct swapchain_data *data)
+static void ring_release(struct device_data *data, struct overlay_ring_alloc &alloc);
+
+/* GPU must be done with the copies */
+static void release_staging(struct device_data *device_data, struct overlay_staging &staging)
+{
+   for (struct overlay_ring_alloc &alloc : staging.allocs)
+      ring_release(device_data, alloc);
+   staging.allocs.clear();
+   for (const auto &buffer : staging.buffers) {
+      device_data->vtable.DestroyBuffer(device_data->device, buffer.first, NULL);
+      device_data->vtable.FreeMemory(device_data->device, buffer.second, NULL);
+   }
+   staging.buffers.clear();
+}
+
+static void print_draw_stats(struct swapchain_data *data)
+{
+#ifndef NDEBUG
+   std::cerr << "imgoverlay: " << data->draws.size() << " draws, "
+             << data->draw_stats.reused << " reused, "
+             << data->draw_stats.allocated << " allocated, "
+             << data->draw_stats.waited << " waited, "
+             << data->draw_stats.skipped << " skipped" << std::endl;
+#endif
+}
+
+/* Called once the draw's fence signaled */
+static void finish_draw(struct device_data *device_data, struct overlay_draw *draw)
+{
+   release_staging(device_data, draw->staging);
+   if (draw->value) {
+      device_data->draws_pending.erase(draw->value);
+      draw->value = 0;
+   }
+}
+
+/* NULL when all draws are busy and params.skip_busy_frames is set */
+struct overlay_draw *get_overlay_draw(struct swapchain_data *data, unsigned image_index)
 {
    struct device_data *device_data = data->device;
-   struct overlay_draw *draw = data->draws.empty() ?
-      nullptr : data->draws.front();
 
    VkSemaphoreCreateInfo sem_info = {};
    sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-   if (draw && device_data->vtable.GetFenceStatus(device_data->device, draw->fence) == VK_SUCCESS) {
+   /* Oldest finished draw, preferably one recorded for this image so its
+    * command buffer can be submitted again
+    */
+   auto found = data->draws.end();
+   for (auto it = data->draws.begin(); it != data->draws.end(); ++it) {
+      if (device_data->vtable.GetFenceStatus(device_data->device, (*it)->fence) != VK_SUCCESS)
+         continue;
+      finish_draw(device_data, *it);
+      if (found == data->draws.end())
+         found = it;
+      if ((*it)->recorded_image == (int)image_index) {
+         found = it;
+         break;
+      }
+   }
+
+   if (found != data->draws.end()) {
+      data->draw_stats.reused++;
+   } else if (data->draws.size() > data->images.size()) {
+      if (device_data->instance->params.skip_busy_frames) {
+         data->draw_stats.skipped++;
+         return NULL;
+      }
+      found = data->draws.begin();
+      VK_CHECK(device_data->vtable.WaitForFences(device_data->device, 1, &(*found)->fence,
+                                                 VK_TRUE, UINT64_MAX));
+      finish_draw(device_data, *found);
+      data->draw_stats.waited++;
+   }
+
+   struct overlay_draw *draw;
+   if (found != data->draws.end()) {
+      draw = *found;
       VK_CHECK(device_data->vtable.ResetFences(device_data->device,
                                                1, &draw->fence));
-      data->draws.pop_front();
+      if (draw->snapshot) {
+         device_data->instance->control->release(draw->snapshot);
+         draw->snapshot = NULL;
+      }
+      data->draws.erase(found);
       data->draws.push_back(draw);
       return draw;
    }
 
    draw = new overlay_draw();
+   draw->recorded_image = -1;
 
    VkCommandBufferAllocateInfo cmd_buffer_info = {};
    cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -416,6 +985,11 @@ struct overlay_draw *get_overlay_draw(struct swapchain_data *data)
                                                        &draw->command_buffer));
    VK_CHECK(device_data->set_device_loader_data(device_data->device,
                                                 draw->command_buffer));
+   VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                       &cmd_buffer_info,
+                                                       &draw->upload_command_buffer));
+   VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                draw->upload_command_buffer));
 
 
    VkFenceCreateInfo fence_info = {};
@@ -430,7 +1004,19 @@ struct overlay_draw *get_overlay_draw(struct swapchain_data *data)
    VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
                                                 NULL, &draw->cross_engine_semaphore));
 
+   if (data->compute) {
+      VkDescriptorSetAllocateInfo alloc_info = {};
+      alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+      alloc_info.descriptorPool = data->compute_pool;
+      alloc_info.descriptorSetCount = 1;
+      alloc_info.pSetLayouts = &device_data->compute_layout;
+      VK_CHECK(device_data->vtable.AllocateDescriptorSets(device_data->device,
+                                                          &alloc_info,
+                                                          &draw->compute_set));
+   }
+
    data->draws.push_back(draw);
+   data->draw_stats.allocated++;
 
    return draw;
 }
@@ -456,76 +1042,219 @@ void check_keybinds(struct overlay_params& params){
    }
 }
 
-void render_imgui(struct swapchain_data *data)
+static void update_image_quads(struct swapchain_data *data)
 {
-    ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0,0));
-    ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0,0));
-    ImGui::PushStyleVar(ImGuiStyleVar_WindowBorderSize, 0.0f);
-
-    const bool no_display = data->device->instance->params.no_display;
-    const std::unordered_map<uint8_t, OverlayImage> &images = data->device->instance->control->images();
+    struct device_data *device_data = data->device;
+    data->quads.clear();
+    if (device_data->instance->params.no_display) {
+        return;
+    }
 
-    for (auto it : images) {
-        const uint8_t id = it.first;
+    const std::unordered_map<uint32_t, OverlayImage> &images = data->snapshot->images;
+    for (const auto &it : images) {
         const OverlayImage &img = it.second;
-        swapchain_data::image_data &img_data = data->images_data[id];
-        if (!img.visible || no_display) {
-            img_data.uploaded_pixels = nullptr;
+        if (!img.visible || (!img.dmabuf && !img.pixels)) {
             continue;
         }
-        if (!img.dmabuf && !img.pixels) {
-            continue;
-        }
-        ImGui::SetNextWindowBgAlpha(0.0);
-        ImGui::SetNextWindowPos(ImVec2(img.x, img.y), ImGuiCond_Always);
-        ImGui::SetNextWindowSize(ImVec2(img.width, img.height), ImGuiCond_Always);
-        char name[4];
-        snprintf(name, 4, "%u", (unsigned)id);
-        ImGui::Begin(name, &_open, ImGuiWindowFlags_NoDecoration);
-        if (img.flip) {
-            ImGui::Image(img_data.desc, ImVec2(img.width, img.height), ImVec2(0, 1), ImVec2(1, 0));
-        } else {
-            ImGui::Image(img_data.desc, ImVec2(img.width, img.height));
-        }
-        ImGui::End();
+        struct overlay_image &img_data = device_data->images[it.first];
+        overlay_quad quad;
+        quad.instance = {
+            { float(img.x), float(img.y), float(img.width), float(img.height) },
+            { 0.0f, img.flip ? 1.0f : 0.0f, 1.0f, img.flip ? 0.0f : 1.0f },
+            0xFFFFFFFF
+        };
+        quad.instance.texture = img_data.tex.bindless_index;
+        quad.desc = img_data.tex.desc;
+        quad.premultiplied = img.premultiplied;
+        data->quads.push_back(quad);
+        // Sampled by the next draw
+        img_data.tex_draw_value = device_data->draw_value + 1;
     }
-
-    ImGui::PopStyleVar(3);
 }
 
 static void create_swapchain_images(struct swapchain_data *data);
+static void submit_swapchain_uploads(struct swapchain_data *data);
 
 static void compute_swapchain_display(struct swapchain_data *data)
 {
-   ImGui::SetCurrentContext(data->imgui_context);
-   ImGui::NewFrame();
-   {
-      create_swapchain_images(data);
-      render_imgui(data);
+   create_swapchain_images(data);
+   submit_swapchain_uploads(data);
+   update_image_quads(data);
+
+   if (data->hud) {
+      ImGui::SetCurrentContext(data->imgui_context);
+      ImGui::NewFrame();
+      ImGui::EndFrame();
+      ImGui::Render();
    }
-
-   ImGui::EndFrame();
-   ImGui::Render();
 }
 
 static uint32_t vk_memory_type(struct device_data *data,
                                VkMemoryPropertyFlags properties,
                                uint32_t type_bits)
 {
-    VkPhysicalDeviceMemoryProperties prop;
-    data->instance->vtable.GetPhysicalDeviceMemoryProperties(data->physical_device, &prop);
+    const VkPhysicalDeviceMemoryProperties &prop = data->memory_properties;
     for (uint32_t i = 0; i < prop.memoryTypeCount; i++)
         if ((prop.memoryTypes[i].propertyFlags & properties) == properties && type_bits & (1<<i))
             return i;
     return 0xFFFFFFFF; // Unable to find memoryType
 }
 
-static void update_image_descriptor(struct swapchain_data *data, VkImageView image_view, VkDescriptorSet set)
+static void print_memory_stats(struct device_data *data)
+{
+#ifndef NDEBUG
+    std::cerr << "imgoverlay: " << data->memory_stats.blocks << " memory blocks, "
+              << data->memory_stats.block_size / 1024 << " KiB, "
+              << data->memory_stats.allocations << " allocations ("
+              << data->memory_stats.dedicated << " dedicated), "
+              << data->memory_stats.allocated / 1024 << " KiB" << std::endl;
+#endif
+}
+
+static bool block_try_alloc(struct overlay_memory_block *block,
+                            const VkMemoryRequirements &req,
+                            struct overlay_allocation &alloc)
+{
+    for (auto it = block->free.begin(); it != block->free.end(); ++it) {
+        const VkDeviceSize offset = (it->first + req.alignment - 1) / req.alignment * req.alignment;
+        const VkDeviceSize end = it->first + it->second;
+        if (offset + req.size > end)
+            continue;
+
+        // Split the free range around the allocation
+        const VkDeviceSize start = it->first;
+        block->free.erase(it);
+        if (offset > start)
+            block->free[start] = offset - start;
+        if (offset + req.size < end)
+            block->free[offset + req.size] = end - offset - req.size;
+
+        alloc.block = block;
+        alloc.mem = block->mem;
+        alloc.offset = offset;
+        alloc.size = req.size;
+        block->used += req.size;
+        return true;
+    }
+    return false;
+}
+
+/* Sub-allocates from a block of a matching memory type, resources bigger
+ * than half a block get memory of their own.
+ */
+static void mem_alloc(struct device_data *data,
+                      const VkMemoryRequirements &req,
+                      VkMemoryPropertyFlags properties,
+                      bool linear,
+                      struct overlay_allocation &alloc)
+{
+    const uint32_t type = vk_memory_type(data, properties, req.memoryTypeBits);
+
+    std::lock_guard<std::mutex> lock(data->memory_mutex);
+    data->memory_stats.allocations++;
+    data->memory_stats.allocated += req.size;
+
+    if (req.size > OVERLAY_MEMORY_BLOCK_SIZE / 2) {
+        VkMemoryAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.allocationSize = req.size;
+        alloc_info.memoryTypeIndex = type;
+        VK_CHECK(data->vtable.AllocateMemory(data->device, &alloc_info, NULL, &alloc.mem));
+        alloc.block = nullptr;
+        alloc.offset = 0;
+        alloc.size = req.size;
+        data->memory_stats.dedicated++;
+        return;
+    }
+
+    for (struct overlay_memory_block *block : data->memory_blocks) {
+        if (block->type == type && block->linear == linear && block_try_alloc(block, req, alloc))
+            return;
+    }
+
+    struct overlay_memory_block *block = new overlay_memory_block();
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = OVERLAY_MEMORY_BLOCK_SIZE;
+    alloc_info.memoryTypeIndex = type;
+    VK_CHECK(data->vtable.AllocateMemory(data->device, &alloc_info, NULL, &block->mem));
+    block->size = OVERLAY_MEMORY_BLOCK_SIZE;
+    block->type = type;
+    block->linear = linear;
+    block->used = 0;
+    block->free[0] = block->size;
+    data->memory_blocks.push_back(block);
+    data->memory_stats.blocks++;
+    data->memory_stats.block_size += block->size;
+    print_memory_stats(data);
+
+    block_try_alloc(block, req, alloc);
+}
+
+/* Blocks that become empty are freed, except the last one of their kind
+ * so overlays coming and going don't allocate every time.
+ */
+static void mem_free(struct device_data *data, struct overlay_allocation &alloc)
+{
+    if (!alloc.mem)
+        return;
+
+    std::lock_guard<std::mutex> lock(data->memory_mutex);
+    struct overlay_memory_block *block = alloc.block;
+    if (!block) {
+        data->vtable.FreeMemory(data->device, alloc.mem, NULL);
+        // Imported memory has no size and isn't counted
+        if (alloc.size) {
+            data->memory_stats.allocations--;
+            data->memory_stats.allocated -= alloc.size;
+            data->memory_stats.dedicated--;
+        }
+        alloc = overlay_allocation();
+        return;
+    }
+    data->memory_stats.allocations--;
+    data->memory_stats.allocated -= alloc.size;
+
+    // Merge with the free neighbours
+    VkDeviceSize offset = alloc.offset;
+    VkDeviceSize size = alloc.size;
+    auto next = block->free.lower_bound(offset);
+    if (next != block->free.end() && next->first == offset + size) {
+        size += next->second;
+        next = block->free.erase(next);
+    }
+    if (next != block->free.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            block->free.erase(prev);
+        }
+    }
+    block->free[offset] = size;
+    block->used -= alloc.size;
+    alloc = overlay_allocation();
+
+    if (block->used)
+        return;
+    for (struct overlay_memory_block *other : data->memory_blocks) {
+        if (other != block && other->type == block->type && other->linear == block->linear) {
+            data->memory_blocks.erase(std::find(data->memory_blocks.begin(), data->memory_blocks.end(), block));
+            data->vtable.FreeMemory(data->device, block->mem, NULL);
+            data->memory_stats.blocks--;
+            data->memory_stats.block_size -= block->size;
+            delete block;
+            print_memory_stats(data);
+            return;
+        }
+    }
+}
+
+static void update_image_descriptor(struct device_data *device_data, VkImageView image_view, VkDescriptorSet set)
 {
-   struct device_data *device_data = data->device;
    /* Descriptor set */
    VkDescriptorImageInfo desc_image[1] = {};
-   desc_image[0].sampler = data->font_sampler;
+   desc_image[0].sampler = device_data->font_sampler;
    desc_image[0].imageView = image_view;
    desc_image[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
    VkWriteDescriptorSet write_desc[1] = {};
@@ -559,78 +1288,36 @@ static void change_image_layout(struct device_data *device_data,
    }
    device_data->vtable.CmdPipelineBarrier(command_buffer,
                                           VK_PIPELINE_STAGE_HOST_BIT,
-                                          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                          device_data->sample_stages,
                                           0, 0, NULL, 0, NULL,
                                           1, &barrier);
 }
 
-static void upload_image_data(struct device_data *device_data,
-                              VkCommandBuffer command_buffer,
-                              void *pixels,
-                              VkDeviceSize upload_size,
-                              uint32_t width,
-                              uint32_t height,
-                              VkBuffer& upload_buffer,
-                              VkDeviceMemory& upload_buffer_mem,
-                              VkImage image,
-                              void **mem_map = NULL)
+/* keep_contents: image was uploaded before and only some of it is copied
+ * transfer_queue: recorded for device_data::transfer_queue, graphics work
+ * on the image is ordered by semaphores instead
+ */
+static void copy_regions_to_image(struct device_data *device_data,
+                                  VkCommandBuffer command_buffer,
+                                  VkBuffer buffer,
+                                  VkImage image,
+                                  const VkBufferImageCopy *regions,
+                                  uint32_t n_regions,
+                                  bool keep_contents,
+                                  bool transfer_queue = false)
 {
-   /* Upload buffer */
-   if (!upload_buffer) {
-       VkBufferCreateInfo buffer_info = {};
-       buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-       buffer_info.size = upload_size;
-       buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-       buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-       VK_CHECK(device_data->vtable.CreateBuffer(device_data->device, &buffer_info,
-                                                 NULL, &upload_buffer));
-       VkMemoryRequirements upload_buffer_req;
-       device_data->vtable.GetBufferMemoryRequirements(device_data->device,
-                                                       upload_buffer,
-                                                       &upload_buffer_req);
-       VkMemoryAllocateInfo upload_alloc_info = {};
-       upload_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-       upload_alloc_info.allocationSize = upload_buffer_req.size;
-       upload_alloc_info.memoryTypeIndex = vk_memory_type(device_data,
-                                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-                                                          upload_buffer_req.memoryTypeBits);
-       VK_CHECK(device_data->vtable.AllocateMemory(device_data->device,
-                                                   &upload_alloc_info,
-                                                   NULL,
-                                                   &upload_buffer_mem));
-       VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device,
-                                                     upload_buffer,
-                                                     upload_buffer_mem, 0));
-   }
-
-   /* Upload to Buffer */
-   void *map = NULL;
-   if (!mem_map || *mem_map == NULL) {
-       VK_CHECK(device_data->vtable.MapMemory(device_data->device,
-                                             upload_buffer_mem,
-                                             0, upload_size, 0, &map));
-   }
-   if (mem_map && *mem_map) {
-       map = *mem_map;
-   }
-   memcpy(map, pixels, upload_size);
-   VkMappedMemoryRange range[1] = {};
-   range[0].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-   range[0].memory = upload_buffer_mem;
-   range[0].size = upload_size;
-   VK_CHECK(device_data->vtable.FlushMappedMemoryRanges(device_data->device, 1, range));
-   if (!mem_map) {
-       device_data->vtable.UnmapMemory(device_data->device,
-                                       upload_buffer_mem);
-   } else if (*mem_map == NULL) {
-        *mem_map = map;
-   }
+   VkPipelineStageFlags src_stages = VK_PIPELINE_STAGE_HOST_BIT;
+   if (transfer_queue)
+      src_stages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+   else if (keep_contents)
+      src_stages |= device_data->sample_stages;
 
    /* Copy buffer to image */
    VkImageMemoryBarrier copy_barrier[1] = {};
    copy_barrier[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+   copy_barrier[0].srcAccessMask = keep_contents && !transfer_queue ? VK_ACCESS_SHADER_READ_BIT : 0;
    copy_barrier[0].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-   copy_barrier[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   copy_barrier[0].oldLayout = keep_contents ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
    copy_barrier[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
    copy_barrier[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
    copy_barrier[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -639,27 +1326,21 @@ static void upload_image_data(struct device_data *device_data,
    copy_barrier[0].subresourceRange.levelCount = 1;
    copy_barrier[0].subresourceRange.layerCount = 1;
    device_data->vtable.CmdPipelineBarrier(command_buffer,
-                                          VK_PIPELINE_STAGE_HOST_BIT,
+                                          src_stages,
                                           VK_PIPELINE_STAGE_TRANSFER_BIT,
                                           0, 0, NULL, 0, NULL,
                                           1, copy_barrier);
 
-   VkBufferImageCopy region = {};
-   region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   region.imageSubresource.layerCount = 1;
-   region.imageExtent.width = width;
-   region.imageExtent.height = height;
-   region.imageExtent.depth = 1;
    device_data->vtable.CmdCopyBufferToImage(command_buffer,
-                                            upload_buffer,
+                                            buffer,
                                             image,
                                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                            1, &region);
+                                            n_regions, regions);
 
    VkImageMemoryBarrier use_barrier[1] = {};
    use_barrier[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
    use_barrier[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-   use_barrier[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+   use_barrier[0].dstAccessMask = transfer_queue ? 0 : VK_ACCESS_SHADER_READ_BIT;
    use_barrier[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
    use_barrier[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
    use_barrier[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -670,53 +1351,203 @@ static void upload_image_data(struct device_data *device_data,
    use_barrier[0].subresourceRange.layerCount = 1;
    device_data->vtable.CmdPipelineBarrier(command_buffer,
                                           VK_PIPELINE_STAGE_TRANSFER_BIT,
-                                          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                          transfer_queue ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : device_data->sample_stages,
                                           0,
                                           0, NULL,
                                           0, NULL,
                                           1, use_barrier);
 }
 
-static VkDescriptorSet import_dmabuf_with_desc(struct swapchain_data *data,
-                                               uint32_t width,
-                                               uint32_t height,
-                                               int format,
-                                               uint64_t modifier,
-                                               const int strides[4],
-                                               const int offsets[4],
-                                               const int fds[4],
-                                               int nfd,
-                                               VkImage& image,
-                                               VkDeviceMemory& image_mem,
-                                               VkImageView& image_view)
+/* Copies from a buffer laid out like the image, e.g. imported shm */
+static void copy_buffer_to_image(struct device_data *device_data,
+                                 VkCommandBuffer command_buffer,
+                                 VkBuffer buffer,
+                                 VkDeviceSize offset,
+                                 uint32_t width,
+                                 uint32_t height,
+                                 VkDeviceSize bpp,
+                                 VkImage image,
+                                 const std::vector<OverlayRect> *damage)
 {
-    struct device_data *device_data = data->device;
-
-    VkImageCreateInfo image_info = {};
-    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    image_info.imageType = VK_IMAGE_TYPE_2D;
-    image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
-    image_info.extent.width = width;
-    image_info.extent.height = height;
-    image_info.extent.depth = 1;
-    image_info.mipLevels = 1;
-    image_info.arrayLayers = 1;
-    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
-    image_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-    image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
-    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   VkBufferImageCopy regions[MAX_DAMAGE_RECTS * MAX_DAMAGE_HISTORY] = {};
+   uint32_t n_regions = 0;
+   if (damage) {
+       for (const OverlayRect &rect : *damage) {
+           VkBufferImageCopy &region = regions[n_regions++];
+           region.bufferOffset = offset + (rect.y * width + rect.x) * bpp;
+           region.bufferRowLength = width;
+           region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+           region.imageSubresource.layerCount = 1;
+           region.imageOffset.x = rect.x;
+           region.imageOffset.y = rect.y;
+           region.imageExtent.width = rect.width;
+           region.imageExtent.height = rect.height;
+           region.imageExtent.depth = 1;
+       }
+   } else {
+       VkBufferImageCopy &region = regions[n_regions++];
+       region.bufferOffset = offset;
+       region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+       region.imageSubresource.layerCount = 1;
+       region.imageExtent.width = width;
+       region.imageExtent.height = height;
+       region.imageExtent.depth = 1;
+   }
+   copy_regions_to_image(device_data, command_buffer, buffer, image, regions, n_regions, damage != NULL);
+}
 
-    VkExternalMemoryImageCreateInfo eimg = {};
-    eimg.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
-    eimg.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-    image_info.pNext = &eimg;
+static uint8_t *ring_alloc(struct device_data *data, struct overlay_ring_pool *pool,
+                           VkDeviceSize size, struct overlay_ring_alloc &alloc);
+static void ring_flush(struct device_data *data, const struct overlay_ring_alloc &alloc);
 
-    VkSubresourceLayout layouts[4] = {};
-    for (int i = 0; i < nfd; ++i) {
-        layouts[i].offset = offsets[i];
-        layouts[i].rowPitch = strides[i];
-    }
+/* Copies pixels to the staging ring, or to a buffer of its own when it
+ * doesn't fit, and records the copy to the image. Both are kept in staging
+ * until the GPU is done with command_buffer.
+ */
+static void upload_image_data(struct device_data *device_data,
+                              VkCommandBuffer command_buffer,
+                              struct overlay_staging &staging,
+                              const void *pixels,
+                              uint32_t width,
+                              uint32_t height,
+                              VkDeviceSize bpp,
+                              VkImage image,
+                              const std::vector<OverlayRect> *damage = NULL,
+                              bool transfer_queue = false)
+{
+   /* With damage only the changed rects are copied, packed one after
+    * another, the rest of the image keeps its previous contents.
+    */
+   OverlayRect full;
+   full.width = width;
+   full.height = height;
+   const OverlayRect *rects = damage ? damage->data() : &full;
+   const uint32_t n_rects = damage ? damage->size() : 1;
+
+   VkBufferImageCopy regions[MAX_DAMAGE_RECTS * MAX_DAMAGE_HISTORY] = {};
+   VkDeviceSize upload_size = 0;
+   for (uint32_t i = 0; i < n_rects; ++i) {
+       const OverlayRect &rect = rects[i];
+       VkBufferImageCopy &region = regions[i];
+       region.bufferOffset = upload_size;
+       region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+       region.imageSubresource.layerCount = 1;
+       region.imageOffset.x = rect.x;
+       region.imageOffset.y = rect.y;
+       region.imageExtent.width = rect.width;
+       region.imageExtent.height = rect.height;
+       region.imageExtent.depth = 1;
+       upload_size += (rect.width * rect.height * bpp + 15) & ~VkDeviceSize(15);
+   }
+
+   struct overlay_ring_alloc alloc;
+   VkBuffer buffer;
+   uint8_t *map = ring_alloc(device_data, &device_data->staging_rings, upload_size, alloc);
+   VkDeviceMemory mem = VK_NULL_HANDLE;
+   if (map) {
+       buffer = alloc.ring->buffer;
+   } else {
+       VkBufferCreateInfo buffer_info = {};
+       buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+       buffer_info.size = upload_size;
+       buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+       buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+       const uint32_t families[2] = { device_data->graphic_queue->family_index, device_data->transfer_family };
+       if (device_data->transfer_queue) {
+           buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+           buffer_info.queueFamilyIndexCount = 2;
+           buffer_info.pQueueFamilyIndices = families;
+       }
+       VK_CHECK(device_data->vtable.CreateBuffer(device_data->device, &buffer_info,
+                                                 NULL, &buffer));
+       VkMemoryRequirements upload_buffer_req;
+       device_data->vtable.GetBufferMemoryRequirements(device_data->device,
+                                                       buffer,
+                                                       &upload_buffer_req);
+       VkMemoryAllocateInfo upload_alloc_info = {};
+       upload_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+       upload_alloc_info.allocationSize = upload_buffer_req.size;
+       upload_alloc_info.memoryTypeIndex = vk_memory_type(device_data,
+                                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                                                          upload_buffer_req.memoryTypeBits);
+       VK_CHECK(device_data->vtable.AllocateMemory(device_data->device,
+                                                   &upload_alloc_info,
+                                                   NULL,
+                                                   &mem));
+       VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device,
+                                                     buffer, mem, 0));
+       VK_CHECK(device_data->vtable.MapMemory(device_data->device, mem,
+                                             0, VK_WHOLE_SIZE, 0, (void**)&map));
+       staging.buffers.push_back({buffer, mem});
+   }
+
+   for (uint32_t i = 0; i < n_rects; ++i) {
+       const OverlayRect &rect = rects[i];
+       uint8_t *dst = map + regions[i].bufferOffset;
+       const VkDeviceSize row_size = rect.width * bpp;
+       if (rect.width == (int)width) {
+           memcpy(dst, static_cast<const uint8_t*>(pixels) + rect.y * row_size, rect.height * row_size);
+           continue;
+       }
+       for (int y = rect.y; y < rect.y + rect.height; ++y, dst += row_size)
+           memcpy(dst, static_cast<const uint8_t*>(pixels) + (y * width + rect.x) * bpp, row_size);
+   }
+
+   if (mem) {
+       VkMappedMemoryRange range[1] = {};
+       range[0].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+       range[0].memory = mem;
+       range[0].size = VK_WHOLE_SIZE;
+       VK_CHECK(device_data->vtable.FlushMappedMemoryRanges(device_data->device, 1, range));
+       device_data->vtable.UnmapMemory(device_data->device, mem);
+   } else {
+       ring_flush(device_data, alloc);
+       staging.allocs.push_back(alloc);
+       for (uint32_t i = 0; i < n_rects; ++i)
+           regions[i].bufferOffset += alloc.offset;
+   }
+
+   copy_regions_to_image(device_data, command_buffer, buffer, image, regions, n_rects, damage != NULL, transfer_queue);
+}
+
+static void import_dmabuf_image(struct device_data *device_data,
+                                uint32_t width,
+                                uint32_t height,
+                                int format,
+                                uint64_t modifier,
+                                const int strides[4],
+                                const int offsets[4],
+                                const int fds[4],
+                                int nfd,
+                                VkImage& image,
+                                VkDeviceMemory& image_mem,
+                                VkImageView& image_view)
+{
+    VkImageCreateInfo image_info = {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    image_info.extent.width = width;
+    image_info.extent.height = height;
+    image_info.extent.depth = 1;
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkExternalMemoryImageCreateInfo eimg = {};
+    eimg.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    eimg.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    image_info.pNext = &eimg;
+
+    VkSubresourceLayout layouts[4] = {};
+    for (int i = 0; i < nfd; ++i) {
+        layouts[i].offset = offsets[i];
+        layouts[i].rowPitch = strides[i];
+    }
     VkImageDrmFormatModifierExplicitCreateInfoEXT modifier_info = {};
     modifier_info.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT;
     modifier_info.drmFormatModifier = modifier;
@@ -784,32 +1615,17 @@ static VkDescriptorSet import_dmabuf_with_desc(struct swapchain_data *data,
     view_info.subresourceRange.layerCount = 1;
     VK_CHECK(device_data->vtable.CreateImageView(device_data->device, &view_info,
                                                  NULL, &image_view));
-
-    VkDescriptorSet descriptor_set;
-
-    VkDescriptorSetAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    alloc_info.descriptorPool = data->descriptor_pool;
-    alloc_info.descriptorSetCount = 1;
-    alloc_info.pSetLayouts = &data->descriptor_layout;
-    VK_CHECK(device_data->vtable.AllocateDescriptorSets(device_data->device,
-                                                        &alloc_info,
-                                                        &descriptor_set));
-
-    update_image_descriptor(data, image_view, descriptor_set);
-    return descriptor_set;
 }
 
-static VkDescriptorSet create_image_with_desc(struct swapchain_data *data,
-                                          uint32_t width,
-                                          uint32_t height,
-                                          VkFormat format,
-                                          VkImage& image,
-                                          VkDeviceMemory& image_mem,
-                                          VkImageView& image_view)
+static void create_image(struct device_data *device_data,
+                         uint32_t width,
+                         uint32_t height,
+                         VkFormat format,
+                         VkImage& image,
+                         struct overlay_allocation& image_mem,
+                         VkImageView& image_view,
+                         VkComponentMapping components = {})
 {
-   struct device_data *device_data = data->device;
-
    VkImageCreateInfo image_info = {};
    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
    image_info.imageType = VK_IMAGE_TYPE_2D;
@@ -824,22 +1640,22 @@ static VkDescriptorSet create_image_with_desc(struct swapchain_data *data,
    image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   /* Written by transfer_queue, no ownership transfers needed */
+   const uint32_t families[2] = { device_data->graphic_queue->family_index, device_data->transfer_family };
+   if (device_data->transfer_queue) {
+      image_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+      image_info.queueFamilyIndexCount = 2;
+      image_info.pQueueFamilyIndices = families;
+   }
    VK_CHECK(device_data->vtable.CreateImage(device_data->device, &image_info,
                                             NULL, &image));
    VkMemoryRequirements font_image_req;
    device_data->vtable.GetImageMemoryRequirements(device_data->device,
                                                   image, &font_image_req);
-   VkMemoryAllocateInfo image_alloc_info = {};
-   image_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-   image_alloc_info.allocationSize = font_image_req.size;
-   image_alloc_info.memoryTypeIndex = vk_memory_type(device_data,
-                                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                     font_image_req.memoryTypeBits);
-   VK_CHECK(device_data->vtable.AllocateMemory(device_data->device, &image_alloc_info,
-                                               NULL, &image_mem));
+   mem_alloc(device_data, font_image_req, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, image_mem);
    VK_CHECK(device_data->vtable.BindImageMemory(device_data->device,
                                                 image,
-                                                image_mem, 0));
+                                                image_mem.mem, image_mem.offset));
 
    /* Font image view */
    VkImageViewCreateInfo view_info = {};
@@ -847,234 +1663,767 @@ static VkDescriptorSet create_image_with_desc(struct swapchain_data *data,
    view_info.image = image;
    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
    view_info.format = format;
+   view_info.components = components;
    view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
    view_info.subresourceRange.levelCount = 1;
    view_info.subresourceRange.layerCount = 1;
    VK_CHECK(device_data->vtable.CreateImageView(device_data->device, &view_info,
                                                 NULL, &image_view));
+}
+
+static void add_descriptor_pool(struct device_data *device_data)
+{
+   const uint32_t count = device_data->instance->params.max_overlays << device_data->descriptor_pools.size();
+
+   VkDescriptorPoolSize sampler_pool_size = {};
+   sampler_pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+   sampler_pool_size.descriptorCount = count;
+   VkDescriptorPoolCreateInfo desc_pool_info = {};
+   desc_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+   desc_pool_info.maxSets = count;
+   desc_pool_info.poolSizeCount = 1;
+   desc_pool_info.pPoolSizes = &sampler_pool_size;
+   desc_pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+   VkDescriptorPool pool;
+   VK_CHECK(device_data->vtable.CreateDescriptorPool(device_data->device,
+                                                     &desc_pool_info,
+                                                     NULL, &pool));
+   device_data->descriptor_pools.push_back(pool);
+}
 
+static VkDescriptorSet alloc_image_descriptor(struct device_data *device_data,
+                                              VkImageView image_view,
+                                              VkDescriptorPool& pool)
+{
    VkDescriptorSet descriptor_set;
 
    VkDescriptorSetAllocateInfo alloc_info = {};
    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-   alloc_info.descriptorPool = data->descriptor_pool;
+   alloc_info.descriptorPool = device_data->descriptor_pools.back();
    alloc_info.descriptorSetCount = 1;
-   alloc_info.pSetLayouts = &data->descriptor_layout;
-   VK_CHECK(device_data->vtable.AllocateDescriptorSets(device_data->device,
+   alloc_info.pSetLayouts = &device_data->descriptor_layout;
+   VkResult ret = device_data->vtable.AllocateDescriptorSets(device_data->device,
+                                                             &alloc_info,
+                                                             &descriptor_set);
+   if (ret == VK_ERROR_OUT_OF_POOL_MEMORY || ret == VK_ERROR_FRAGMENTED_POOL) {
+      add_descriptor_pool(device_data);
+      alloc_info.descriptorPool = device_data->descriptor_pools.back();
+      ret = device_data->vtable.AllocateDescriptorSets(device_data->device,
                                                        &alloc_info,
-                                                       &descriptor_set));
+                                                       &descriptor_set);
+   }
+   VK_CHECK(ret);
 
-   update_image_descriptor(data, image_view, descriptor_set);
+   pool = alloc_info.descriptorPool;
+   update_image_descriptor(device_data, image_view, descriptor_set);
    return descriptor_set;
 }
 
-static void ensure_swapchain_fonts(struct swapchain_data *data,
-                                   VkCommandBuffer command_buffer)
+/* Takes the least recently freed array element, in flight frames
+ * may still sample the image that used it last.
+ */
+static uint32_t alloc_bindless_descriptor(struct device_data *device_data,
+                                          VkImageView image_view)
+{
+   const uint32_t index = device_data->bindless_free.front();
+   device_data->bindless_free.pop_front();
+
+   VkDescriptorImageInfo desc_image[1] = {};
+   desc_image[0].imageView = image_view;
+   desc_image[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+   VkWriteDescriptorSet write_desc[1] = {};
+   write_desc[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+   write_desc[0].dstSet = device_data->bindless_set;
+   write_desc[0].dstBinding = 1;
+   write_desc[0].dstArrayElement = index;
+   write_desc[0].descriptorCount = 1;
+   write_desc[0].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+   write_desc[0].pImageInfo = desc_image;
+   device_data->vtable.UpdateDescriptorSets(device_data->device, 1, write_desc, 0, NULL);
+   return index;
+}
+
+/* Returns whether anything was recorded */
+static bool ensure_swapchain_fonts(struct swapchain_data *data,
+                                   struct overlay_draw *draw)
 {
    struct device_data *device_data = data->device;
-   if (data->font_uploaded)
-      return;
+   if (device_data->font_uploaded)
+      return false;
 
-   data->font_uploaded = true;
+   device_data->font_uploaded = true;
    ImGuiIO& io = ImGui::GetIO();
    unsigned char* pixels;
    int width, height;
    io.Fonts->GetTexDataAsAlpha8(&pixels, &width, &height);
-   size_t upload_size = width * height * 1 * sizeof(char);
-   upload_image_data(device_data, command_buffer, pixels, upload_size, width, height, data->upload_font_buffer, data->upload_font_buffer_mem, data->font_image);
+   upload_image_data(device_data, draw->upload_command_buffer, draw->staging, pixels, width, height, 1, device_data->font_image);
+   return true;
 }
 
-static void destroy_swapchain_image(struct swapchain_data *data, const swapchain_data::image_data &img_data)
+static void destroy_texture(struct device_data *device_data, const struct overlay_texture &tex)
 {
-    struct device_data *device_data = data->device;
-    if (img_data.upload_buffer_mem) {
-        device_data->vtable.UnmapMemory(device_data->device, img_data.upload_buffer_mem);
+    if (!tex.image)
+        return;
+    if (tex.desc)
+        device_data->vtable.FreeDescriptorSets(device_data->device, tex.desc_pool, 1, &tex.desc);
+    else
+        device_data->bindless_free.push_back(tex.bindless_index);
+    device_data->vtable.DestroyImageView(device_data->device, tex.image_view, NULL);
+    device_data->vtable.DestroyImage(device_data->device, tex.image, NULL);
+    struct overlay_allocation mem = tex.mem;
+    mem_free(device_data, mem);
+}
+
+/* No draw or upload may use the image anymore */
+static void destroy_overlay_image(struct device_data *device_data, const struct overlay_image &img_data)
+{
+    destroy_texture(device_data, img_data.tex);
+    destroy_texture(device_data, img_data.back);
+    /* Imported memory has to go before the mapping, host_memory ref keeps it */
+    if (img_data.host_buffer) {
+        device_data->vtable.DestroyBuffer(device_data->device, img_data.host_buffer, NULL);
+        device_data->vtable.FreeMemory(device_data->device, img_data.host_buffer_mem, NULL);
+    }
+}
+
+/* Highest draw_value whose draw and all earlier ones finished */
+static uint64_t completed_draw_value(struct device_data *device_data)
+{
+    if (device_data->timeline_semaphore) {
+        uint64_t value;
+        VK_CHECK(device_data->vtable.GetSemaphoreCounterValueKHR(device_data->device,
+                                                                 device_data->draw_timeline,
+                                                                 &value));
+        return value;
+    }
+    if (device_data->draws_pending.empty())
+        return device_data->draw_value;
+    return *device_data->draws_pending.begin() - 1;
+}
+
+static void destroy_retired_images(struct device_data *device_data)
+{
+    if (device_data->retired_images.empty())
+        return;
+
+    const uint64_t draw_value = completed_draw_value(device_data);
+    uint64_t upload_value = 0;
+    if (device_data->transfer_queue)
+        VK_CHECK(device_data->vtable.GetSemaphoreCounterValueKHR(device_data->device,
+                                                                 device_data->upload_timeline,
+                                                                 &upload_value));
+    for (auto it = device_data->retired_images.begin(); it != device_data->retired_images.end();) {
+        if (it->draw_value > draw_value || it->upload_value > upload_value) {
+            ++it;
+            continue;
+        }
+        destroy_overlay_image(device_data, it->image);
+        it = device_data->retired_images.erase(it);
+    }
+}
+
+static void import_host_buffer(struct device_data *device_data,
+                               const OverlayImage &img,
+                               struct overlay_image &img_data)
+{
+    if (!device_data->external_memory_host || !img.memory) {
+        return;
+    }
+
+    /* Both pointer and size must be aligned, rounding the size up has to
+     * stay within the last mapped page.
+     */
+    const VkDeviceSize alignment = device_data->min_imported_host_pointer_alignment;
+    const VkDeviceSize page_size = sysconf(_SC_PAGESIZE);
+    if (alignment == 0 || alignment > page_size || (uintptr_t)img.memory->data % alignment) {
+        return;
+    }
+    const VkDeviceSize size = (img.memory->size + alignment - 1) & ~(alignment - 1);
+
+    VkMemoryHostPointerPropertiesEXT host_props = {};
+    host_props.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    if (device_data->vtable.GetMemoryHostPointerPropertiesEXT(device_data->device,
+                                                              VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+                                                              img.memory->data, &host_props) != VK_SUCCESS) {
+        return;
+    }
+
+    VkExternalMemoryBufferCreateInfo ext_info = {};
+    ext_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    ext_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+    VkBufferCreateInfo buffer_info = {};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.pNext = &ext_info;
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VkBuffer buffer;
+    if (device_data->vtable.CreateBuffer(device_data->device, &buffer_info, NULL, &buffer) != VK_SUCCESS) {
+        return;
     }
-    device_data->vtable.FreeDescriptorSets(device_data->device, data->descriptor_pool, 1, &img_data.desc);
-    device_data->vtable.DestroyImageView(device_data->device, img_data.image_view, NULL);
-    device_data->vtable.DestroyImage(device_data->device, img_data.image, NULL);
-    device_data->vtable.FreeMemory(device_data->device, img_data.mem, NULL);
-    if (img_data.upload_buffer) {
-        device_data->vtable.DestroyBuffer(device_data->device, img_data.upload_buffer, NULL);
-        device_data->vtable.FreeMemory(device_data->device, img_data.upload_buffer_mem, NULL);
+
+    VkMemoryRequirements req;
+    device_data->vtable.GetBufferMemoryRequirements(device_data->device, buffer, &req);
+    const uint32_t type = vk_memory_type(device_data, 0, req.memoryTypeBits & host_props.memoryTypeBits);
+    if (type == 0xFFFFFFFF || req.size > size) {
+        device_data->vtable.DestroyBuffer(device_data->device, buffer, NULL);
+        return;
+    }
+
+    VkImportMemoryHostPointerInfoEXT import_info = {};
+    import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    import_info.pHostPointer = img.memory->data;
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext = &import_info;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = type;
+    VkDeviceMemory mem;
+    if (device_data->vtable.AllocateMemory(device_data->device, &alloc_info, NULL, &mem) != VK_SUCCESS) {
+        device_data->vtable.DestroyBuffer(device_data->device, buffer, NULL);
+        return;
+    }
+    VK_CHECK(device_data->vtable.BindBufferMemory(device_data->device, buffer, mem, 0));
+
+    img_data.host_buffer = buffer;
+    img_data.host_buffer_mem = mem;
+    img_data.host_memory = img.memory;
+}
+
+static VkFormat shm_format_to_vk(int format, VkComponentMapping &components)
+{
+    components = {};
+    switch (format) {
+    case SHM_FORMAT_BGRA8:
+        return VK_FORMAT_B8G8R8A8_UNORM;
+    case SHM_FORMAT_RGB565:
+        return VK_FORMAT_R5G6B5_UNORM_PACK16;
+    case SHM_FORMAT_A8:
+        components = { VK_COMPONENT_SWIZZLE_ONE, VK_COMPONENT_SWIZZLE_ONE, VK_COMPONENT_SWIZZLE_ONE, VK_COMPONENT_SWIZZLE_R };
+        return VK_FORMAT_R8_UNORM;
+    case SHM_FORMAT_L8:
+        components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_ONE };
+        return VK_FORMAT_R8_UNORM;
+    default:
+        return VK_FORMAT_R8G8B8A8_UNORM;
     }
 }
 
+static void alloc_texture_descriptor(struct device_data *device_data, struct overlay_texture &tex)
+{
+    if (device_data->bindless && !device_data->bindless_free.empty())
+        tex.bindless_index = alloc_bindless_descriptor(device_data, tex.image_view);
+    else
+        tex.desc = alloc_image_descriptor(device_data, tex.image_view, tex.desc_pool);
+}
+
+static void create_shm_texture(struct device_data *device_data, const OverlayImage &img, struct overlay_texture &tex)
+{
+    VkComponentMapping components = {};
+    const VkFormat format = shm_format_to_vk(img.shmFormat, components);
+    create_image(device_data, img.width, img.height, format, tex.image, tex.mem, tex.image_view, components);
+    alloc_texture_descriptor(device_data, tex);
+}
+
 static void create_swapchain_images(struct swapchain_data *data)
 {
     struct device_data *device_data = data->device;
-    const std::unordered_map<uint8_t, OverlayImage> &images = device_data->instance->control->images();
+    const std::unordered_map<uint32_t, OverlayImage> &images = data->snapshot->images;
+
+    for (auto it = data->fence_serials.begin(); it != data->fence_serials.end();) {
+        if (images.find(it->first) == images.end())
+            it = data->fence_serials.erase(it);
+        else
+            ++it;
+    }
+
+    // Destroyed, first so their descriptors can be reused
+    destroy_retired_images(device_data);
+
+    // Removed, draws of any swapchain may still sample them
+    for (auto it = device_data->images.begin(); it != device_data->images.end();) {
+        if (images.find(it->first) != images.end()) {
+            ++it;
+            continue;
+        }
+        device_data->retired_images.push_back({it->second, device_data->draw_value, device_data->upload_value});
+        it = device_data->images.erase(it);
+    }
 
-    // Created
-    for (auto it : images) {
-        const uint8_t id = it.first;
-        if (data->images_data.find(id) != data->images_data.end()) {
+    // Created, by whichever swapchain presents first
+    for (const auto &it : images) {
+        const uint32_t id = it.first;
+        if (device_data->images.find(id) != device_data->images.end()) {
             continue;
         }
         const OverlayImage &img = it.second;
-        swapchain_data::image_data img_data;
+        struct overlay_image img_data;
         if (img.dmabuf) {
             img_data.needs_layout = true;
-            img_data.desc = import_dmabuf_with_desc(data, img.width, img.height, img.format, img.modifier, img.strides, img.offsets, img.dmabufs, img.nfd, img_data.image, img_data.mem, img_data.image_view);
+            import_dmabuf_image(device_data, img.width, img.height, img.format, img.modifier, img.strides, img.offsets, img.dmabufs, img.nfd, img_data.tex.image, img_data.tex.mem.mem, img_data.tex.image_view);
+            alloc_texture_descriptor(device_data, img_data.tex);
         } else {
-            img_data.desc = create_image_with_desc(data, img.width, img.height, VK_FORMAT_R8G8B8A8_UNORM, img_data.image, img_data.mem, img_data.image_view);
+            create_shm_texture(device_data, img, img_data.tex);
+            import_host_buffer(device_data, img, img_data);
         }
-        data->images_data.insert({id, img_data});
+        device_data->images.insert({id, img_data});
     }
+}
+
+/* Zero copy images are read by the draw itself, nothing to copy on the
+ * transfer queue
+ */
+static bool uses_transfer_queue(struct device_data *device_data,
+                                const OverlayImage &img,
+                                const struct overlay_image &img_data)
+{
+    return device_data->transfer_queue && !img.dmabuf &&
+        !(img_data.host_buffer && img_data.host_memory == img.memory);
+}
+
+/* Returns whether anything was recorded */
+static bool ensure_swapchain_images(struct swapchain_data *data,
+                                    struct overlay_draw *draw)
+{
+    struct device_data *device_data = data->device;
+    VkCommandBuffer command_buffer = draw->upload_command_buffer;
+    const std::unordered_map<uint32_t, OverlayImage> &images = data->snapshot->images;
+    bool recorded = false;
 
-    // Destroyed
-    std::vector<uint8_t> to_erase;
-    for (auto it : data->images_data) {
-        const uint8_t id = it.first;
-        if (images.find(id) != images.end()) {
+    for (const auto &it : images) {
+        const uint32_t id = it.first;
+        const OverlayImage &img = it.second;
+        struct overlay_image &img_data = device_data->images[id];
+        if (img_data.needs_layout) {
+            img_data.needs_layout = false;
+            change_image_layout(device_data, command_buffer, img_data.tex.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_SHADER_READ_BIT, img.dmabuf);
+            recorded = true;
+        }
+        if (img.dmabuf || !img.pixels || img.serial == img_data.tex.uploaded_serial) {
+            continue;
+        }
+        if (uses_transfer_queue(device_data, img, img_data)) {
+            continue;
+        }
+        // Hidden images are brought up to date once they are shown again
+        if (!img.visible || device_data->instance->params.no_display) {
+            continue;
+        }
+        const bool partial = img.damageSince(img_data.tex.uploaded_serial, data->damage_rects);
+        img_data.tex.uploaded_serial = img.serial;
+        if (partial && data->damage_rects.empty()) {
+            continue;
+        }
+        recorded = true;
+        if (img_data.host_buffer && img_data.host_memory == img.memory) {
+            /* Zero copy, GPU reads straight from the client buffer */
+            const VkDeviceSize offset = img.pixels - static_cast<uint8_t*>(img.memory->data);
+            copy_buffer_to_image(device_data, command_buffer, img_data.host_buffer, offset, img.width, img.height, shm_format_bpp(img.shmFormat), img_data.tex.image, partial ? &data->damage_rects : NULL);
             continue;
         }
-        destroy_swapchain_image(data, it.second);
-        to_erase.push_back(id);
+        upload_image_data(device_data, command_buffer, draw->staging, img.pixels, img.width, img.height, shm_format_bpp(img.shmFormat), img_data.tex.image, partial ? &data->damage_rects : NULL);
+    }
+    return recorded;
+}
+
+/* Oldest finished upload, its command buffer is ready to be recorded */
+static struct overlay_upload *get_overlay_upload(struct device_data *device_data, uint64_t completed)
+{
+    auto found = device_data->uploads.end();
+    for (auto it = device_data->uploads.begin(); it != device_data->uploads.end(); ++it) {
+        if ((*it)->value > completed)
+            continue;
+        release_staging(device_data, (*it)->staging);
+        if (found == device_data->uploads.end())
+            found = it;
     }
-    for (uint8_t id : to_erase) {
-        data->images_data.erase(id);
+
+    struct overlay_upload *upload;
+    if (found != device_data->uploads.end()) {
+        upload = *found;
+        device_data->uploads.erase(found);
+        device_data->uploads.push_back(upload);
+        device_data->vtable.ResetCommandBuffer(upload->command_buffer, 0);
+        return upload;
     }
+
+    upload = new overlay_upload();
+    VkCommandBufferAllocateInfo cmd_buffer_info = {};
+    cmd_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buffer_info.commandPool = device_data->transfer_command_pool;
+    cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buffer_info.commandBufferCount = 1;
+    VK_CHECK(device_data->vtable.AllocateCommandBuffers(device_data->device,
+                                                        &cmd_buffer_info,
+                                                        &upload->command_buffer));
+    VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                 upload->command_buffer));
+    device_data->uploads.push_back(upload);
+    return upload;
 }
 
-static void ensure_swapchain_images(struct swapchain_data *data,
-                                   VkCommandBuffer command_buffer)
+static void swap_textures(struct device_data *device_data, struct overlay_image &img_data)
 {
-    struct device_data *device_data = data->device;
-    const std::unordered_map<uint8_t, OverlayImage> &images = device_data->instance->control->images();
+    std::swap(img_data.tex, img_data.back);
+    std::swap(img_data.tex_draw_value, img_data.back_draw_value);
+    img_data.back_upload_value = 0;
+    device_data->texture_swaps++;
+}
 
-    for (auto it : images) {
-        const uint8_t id = it.first;
+/* Copies new shm contents to back textures on the transfer queue. Draws
+ * keep sampling the older contents until the copy finished, only images
+ * that have nothing to show yet make the next draw wait for it.
+ */
+static void submit_swapchain_uploads(struct swapchain_data *data)
+{
+    struct device_data *device_data = data->device;
+    if (!device_data->transfer_queue)
+        return;
+
+    uint64_t completed = 0;
+    VK_CHECK(device_data->vtable.GetSemaphoreCounterValueKHR(device_data->device,
+                                                             device_data->upload_timeline,
+                                                             &completed));
+
+    struct overlay_upload *upload = NULL;
+    uint64_t wait_value = 0; // last draw sampling any of the back textures
+    const uint64_t value = device_data->upload_value + 1;
+    for (const auto &it : data->snapshot->images) {
         const OverlayImage &img = it.second;
-        swapchain_data::image_data &img_data = data->images_data[id];
-        if (img_data.needs_layout) {
-            img_data.needs_layout = false;
-            change_image_layout(device_data, command_buffer, img_data.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_SHADER_READ_BIT, img.dmabuf);
+        struct overlay_image &img_data = device_data->images[it.first];
+        if (!img.pixels || !uses_transfer_queue(device_data, img, img_data))
+            continue;
+        if (img_data.back_upload_value) {
+            if (img_data.back_upload_value > completed)
+                continue;
+            swap_textures(device_data, img_data);
         }
-        if (img.dmabuf || img.pixels == img_data.uploaded_pixels) {
+        if (img.serial == img_data.tex.uploaded_serial)
             continue;
+        // Hidden images are brought up to date once they are shown again
+        if (!img.visible || device_data->instance->params.no_display)
+            continue;
+
+        if (!img_data.back.image)
+            create_shm_texture(device_data, img, img_data.back);
+        const bool partial = img.damageSince(img_data.back.uploaded_serial, data->damage_rects);
+        img_data.back.uploaded_serial = img.serial;
+        if (partial && data->damage_rects.empty()) {
+            swap_textures(device_data, img_data);
+            continue;
+        }
+
+        if (!upload) {
+            upload = get_overlay_upload(device_data, completed);
+            VkCommandBufferBeginInfo begin_info = {};
+            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            device_data->vtable.BeginCommandBuffer(upload->command_buffer, &begin_info);
+        }
+        upload_image_data(device_data, upload->command_buffer, upload->staging, img.pixels, img.width, img.height, shm_format_bpp(img.shmFormat), img_data.back.image, partial ? &data->damage_rects : NULL, true);
+        wait_value = std::max(wait_value, img_data.back_draw_value);
+        img_data.back_upload_value = value;
+
+        if (!img_data.tex.uploaded_serial) {
+            /* Nothing older to sample */
+            swap_textures(device_data, img_data);
+            device_data->draw_wait_value = value;
         }
-        img_data.uploaded_pixels = img.pixels;
-        VkDeviceSize upload_size = img.width * img.height * 4;
-        upload_image_data(device_data, command_buffer, img.pixels, upload_size, img.width, img.height, img_data.upload_buffer, img_data.upload_buffer_mem, img_data.image, &img_data.upload_buffer_mem_map);
     }
+    device_data->draw_wait = device_data->draw_wait_value > completed;
+    if (!upload)
+        return;
+    device_data->vtable.EndCommandBuffer(upload->command_buffer);
+
+    /* Draws still sampling the back textures have to finish first */
+    VkTimelineSemaphoreSubmitInfoKHR timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+    timeline_info.waitSemaphoreValueCount = wait_value ? 1 : 0;
+    timeline_info.pWaitSemaphoreValues = &wait_value;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &value;
+    const VkPipelineStageFlags stage_wait = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = timeline_info.waitSemaphoreValueCount;
+    submit_info.pWaitSemaphores = &device_data->draw_timeline;
+    submit_info.pWaitDstStageMask = &stage_wait;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &upload->command_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &device_data->upload_timeline;
+
+    std::lock_guard<std::mutex> lock(device_data->transfer_mutex);
+    VK_CHECK(device_data->vtable.QueueSubmit(device_data->transfer_queue, 1, &submit_info, VK_NULL_HANDLE));
+    upload->value = value;
+    device_data->upload_value = value;
 }
 
-static void CreateOrResizeBuffer(struct device_data *data,
-                                 VkBuffer *buffer,
-                                 VkDeviceMemory *buffer_memory,
-                                 VkDeviceSize *buffer_size,
-                                 size_t new_size, VkBufferUsageFlagBits usage)
+static struct overlay_ring *create_ring(struct device_data *data, struct overlay_ring_pool *pool,
+                                        VkDeviceSize size)
 {
-    if (*buffer != VK_NULL_HANDLE)
-        data->vtable.DestroyBuffer(data->device, *buffer, NULL);
-    if (*buffer_memory)
-        data->vtable.FreeMemory(data->device, *buffer_memory, NULL);
+    struct overlay_ring *ring = new overlay_ring();
+    ring->pool = pool;
 
     VkBufferCreateInfo buffer_info = {};
     buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    buffer_info.size = new_size;
-    buffer_info.usage = usage;
+    buffer_info.size = size;
+    buffer_info.usage = pool->usage;
     buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    VK_CHECK(data->vtable.CreateBuffer(data->device, &buffer_info, NULL, buffer));
+    /* Staging is copied from by transfer_queue and the graphics queue */
+    const uint32_t families[2] = { data->graphic_queue->family_index, data->transfer_family };
+    if (pool == &data->staging_rings && data->transfer_queue) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = 2;
+        buffer_info.pQueueFamilyIndices = families;
+    }
+    VK_CHECK(data->vtable.CreateBuffer(data->device, &buffer_info, NULL, &ring->buffer));
 
     VkMemoryRequirements req;
-    data->vtable.GetBufferMemoryRequirements(data->device, *buffer, &req);
+    data->vtable.GetBufferMemoryRequirements(data->device, ring->buffer, &req);
     VkMemoryAllocateInfo alloc_info = {};
     alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
     alloc_info.allocationSize = req.size;
     alloc_info.memoryTypeIndex =
-       vk_memory_type(data, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, req.memoryTypeBits);
-    VK_CHECK(data->vtable.AllocateMemory(data->device, &alloc_info, NULL, buffer_memory));
+       vk_memory_type(data, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, req.memoryTypeBits);
+    ring->coherent = alloc_info.memoryTypeIndex != 0xFFFFFFFF;
+    if (!ring->coherent)
+       alloc_info.memoryTypeIndex =
+          vk_memory_type(data, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, req.memoryTypeBits);
+    VK_CHECK(data->vtable.AllocateMemory(data->device, &alloc_info, NULL, &ring->mem));
+
+    VK_CHECK(data->vtable.BindBufferMemory(data->device, ring->buffer, ring->mem, 0));
+    VK_CHECK(data->vtable.MapMemory(data->device, ring->mem, 0, VK_WHOLE_SIZE, 0, (void**)&ring->map));
+    ring->size = size;
+    return ring;
+}
 
-    VK_CHECK(data->vtable.BindBufferMemory(data->device, *buffer, *buffer_memory, 0));
-    *buffer_size = req.size;
+static void destroy_ring(struct device_data *data, struct overlay_ring *ring)
+{
+    data->vtable.UnmapMemory(data->device, ring->mem);
+    data->vtable.DestroyBuffer(data->device, ring->buffer, NULL);
+    data->vtable.FreeMemory(data->device, ring->mem, NULL);
+    delete ring;
 }
 
-static struct overlay_draw *render_swapchain_display(struct swapchain_data *data,
-                                                     struct queue_data *present_queue,
-                                                     const VkSemaphore *wait_semaphores,
-                                                     unsigned n_wait_semaphores,
-                                                     unsigned image_index)
+static bool ring_try_alloc(struct overlay_ring *ring, VkDeviceSize size, struct overlay_ring_alloc &alloc)
 {
-   ImDrawData* draw_data = ImGui::GetDrawData();
-   if (draw_data->TotalVtxCount == 0)
-      return NULL;
+    /* Allocations don't wrap, the space up to the end is skipped instead */
+    const VkDeviceSize offset = ring->head % ring->size;
+    const VkDeviceSize pad = offset + size > ring->size ? ring->size - offset : 0;
+    if (ring->head + pad + size - ring->tail > ring->size)
+        return false;
+
+    alloc.ring = ring;
+    alloc.offset = pad ? 0 : offset;
+    alloc.size = size;
+    ring->head += pad + size;
+    alloc.end = ring->head;
+    ring->allocs.push_back({alloc.end, false});
+    return true;
+}
+
+/* Returns mapped memory for size bytes at alloc.offset of alloc.ring->buffer,
+ * valid until ring_release(). NULL when a pool that doesn't grow is full.
+ */
+static uint8_t *ring_alloc(struct device_data *data, struct overlay_ring_pool *pool,
+                           VkDeviceSize size, struct overlay_ring_alloc &alloc)
+{
+    std::lock_guard<std::mutex> lock(pool->mutex);
+
+    /* Keeps offsets aligned for vertex/index binding, copies and flushes */
+    const VkDeviceSize align = std::max<VkDeviceSize>(16, data->properties.limits.nonCoherentAtomSize);
+    size = (size + align - 1) / align * align;
+
+    if (!pool->grow) {
+        if (size > pool->size)
+            return NULL;
+        if (!pool->ring)
+            pool->ring = create_ring(data, pool, (pool->size + align - 1) / align * align);
+        if (!ring_try_alloc(pool->ring, size, alloc))
+            return NULL;
+        return alloc.ring->map + alloc.offset;
+    }
 
+    if (!pool->ring || !ring_try_alloc(pool->ring, size, alloc)) {
+        VkDeviceSize ring_size = pool->size;
+        if (pool->ring) {
+            ring_size = pool->ring->size * 2;
+            if (pool->ring->allocs.empty())
+                destroy_ring(data, pool->ring);
+            else
+                pool->retired.push_back(pool->ring);
+        }
+        while (ring_size < size)
+            ring_size *= 2;
+        pool->ring = create_ring(data, pool, (ring_size + align - 1) / align * align);
+        ring_try_alloc(pool->ring, size, alloc);
+    }
+    return alloc.ring->map + alloc.offset;
+}
+
+static void ring_flush(struct device_data *data, const struct overlay_ring_alloc &alloc)
+{
+    if (alloc.ring->coherent)
+        return;
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = alloc.ring->mem;
+    range.offset = alloc.offset;
+    range.size = alloc.size;
+    VK_CHECK(data->vtable.FlushMappedMemoryRanges(data->device, 1, &range));
+}
+
+/* GPU must be done with the allocation */
+static void ring_release(struct device_data *data, struct overlay_ring_alloc &alloc)
+{
+    if (!alloc.ring)
+        return;
+
+    struct overlay_ring *ring = alloc.ring;
+    struct overlay_ring_pool *pool = ring->pool;
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    for (auto &it : ring->allocs) {
+        if (it.first == alloc.end) {
+            it.second = true;
+            break;
+        }
+    }
+    while (!ring->allocs.empty() && ring->allocs.front().second) {
+        ring->tail = ring->allocs.front().first;
+        ring->allocs.pop_front();
+    }
+    if (ring != pool->ring && ring->allocs.empty()) {
+        pool->retired.erase(std::find(pool->retired.begin(), pool->retired.end(), ring));
+        destroy_ring(data, ring);
+    }
+    alloc = overlay_ring_alloc();
+}
+
+/* Imports acquire fences of visible images not waited on yet */
+static void import_acquire_fences(struct swapchain_data *data,
+                                  struct overlay_draw *draw,
+                                  uint32_t *n_acquire_semaphores)
+{
    struct device_data *device_data = data->device;
-   struct overlay_draw *draw = get_overlay_draw(data);
+   *n_acquire_semaphores = 0;
+   if (!device_data->external_semaphore_fd || device_data->instance->params.no_display)
+      return;
 
-   device_data->vtable.ResetCommandBuffer(draw->command_buffer, 0);
+   for (const auto &it : data->snapshot->images) {
+      const OverlayImage &img = it.second;
+      uint64_t &fence_serial = data->fence_serials[it.first];
+      if (!img.visible)
+         continue;
+      if (!img.acquireFence || fence_serial == img.serial)
+         continue;
+      fence_serial = img.serial;
+
+      if (*n_acquire_semaphores == draw->acquire_semaphores.size()) {
+         VkSemaphoreCreateInfo sem_info = {};
+         sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+         VkSemaphore semaphore;
+         VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                      NULL, &semaphore));
+         draw->acquire_semaphores.push_back(semaphore);
+      }
 
-   VkRenderPassBeginInfo render_pass_info = {};
-   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-   render_pass_info.renderPass = data->render_pass;
-   render_pass_info.framebuffer = data->framebuffers[image_index];
-   render_pass_info.renderArea.extent.width = data->width;
-   render_pass_info.renderArea.extent.height = data->height;
+      /* Temporary import, semaphore is back to its empty permanent payload
+       * once the wait completed. Import takes ownership of the fd.
+       */
+      VkImportSemaphoreFdInfoKHR import_info = {};
+      import_info.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR;
+      import_info.semaphore = draw->acquire_semaphores[*n_acquire_semaphores];
+      import_info.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT;
+      import_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+      import_info.fd = fcntl(img.acquireFence->fd, F_DUPFD_CLOEXEC, 0);
+      if (import_info.fd < 0 ||
+          device_data->vtable.ImportSemaphoreFdKHR(device_data->device, &import_info) != VK_SUCCESS) {
+         std::cerr << "imgoverlay: Failed to import acquire fence" << std::endl;
+         if (import_info.fd >= 0)
+            close(import_info.fd);
+         continue;
+      }
+      (*n_acquire_semaphores)++;
+   }
+}
 
-   VkCommandBufferBeginInfo buffer_begin_info = {};
-   buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+/* Draws all visible images as instanced quads, one instance per image */
+static void render_image_quads(struct swapchain_data *data,
+                               struct overlay_draw *draw,
+                               VkDeviceSize offset)
+{
+   struct device_data *device_data = data->device;
+   const struct overlay_ring_alloc &alloc = draw->vertex_alloc;
 
-   device_data->vtable.BeginCommandBuffer(draw->command_buffer, &buffer_begin_info);
+   /* Upload instance data */
+   overlay_instance* instance_dst = (overlay_instance*)(alloc.ring->map + alloc.offset + offset);
+   for (const overlay_quad &quad : data->quads)
+      *instance_dst++ = quad.instance;
 
-   ensure_swapchain_fonts(data, draw->command_buffer);
-   ensure_swapchain_images(data, draw->command_buffer);
+   VkDeviceSize instance_offset = alloc.offset + offset;
+   device_data->vtable.CmdBindVertexBuffers(draw->command_buffer, 0, 1, &alloc.ring->buffer, &instance_offset);
 
-   /* Bounce the image to display back to color attachment layout for
-    * rendering on top of it.
+   VkRect2D scissor = {};
+   scissor.extent.width = data->width;
+   scissor.extent.height = data->height;
+   device_data->vtable.CmdSetScissor(draw->command_buffer, 0, 1, &scissor);
+
+   /* Images in the bindless array share one set, one draw per run of
+    * them with the same blend mode. Images with their own descriptor set
+    * are a draw each. The pipeline only changes with either.
     */
-   VkImageMemoryBarrier imb;
-   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-   imb.pNext = nullptr;
-   imb.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-   imb.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-   imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-   imb.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-   imb.image = data->images[image_index];
-   imb.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   imb.subresourceRange.baseMipLevel = 0;
-   imb.subresourceRange.levelCount = 1;
-   imb.subresourceRange.baseArrayLayer = 0;
-   imb.subresourceRange.layerCount = 1;
-   imb.srcQueueFamilyIndex = present_queue->family_index;
-   imb.dstQueueFamilyIndex = device_data->graphic_queue->family_index;
-   device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
-                                          VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
-                                          VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
-                                          0,          /* dependency flags */
-                                          0, nullptr, /* memory barriers */
-                                          0, nullptr, /* buffer memory barriers */
-                                          1, &imb);   /* image memory barriers */
-
-   device_data->vtable.CmdBeginRenderPass(draw->command_buffer, &render_pass_info,
-                                          VK_SUBPASS_CONTENTS_INLINE);
-
-   /* Create/Resize vertex & index buffers */
-   size_t vertex_size = draw_data->TotalVtxCount * sizeof(ImDrawVert);
-   size_t index_size = draw_data->TotalIdxCount * sizeof(ImDrawIdx);
-   if (draw->vertex_buffer_size < vertex_size) {
-      CreateOrResizeBuffer(device_data,
-                           &draw->vertex_buffer,
-                           &draw->vertex_buffer_mem,
-                           &draw->vertex_buffer_size,
-                           vertex_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-   }
-   if (draw->index_buffer_size < index_size) {
-      CreateOrResizeBuffer(device_data,
-                           &draw->index_buffer,
-                           &draw->index_buffer_mem,
-                           &draw->index_buffer_size,
-                           index_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+   VkPipeline bound_pipeline = VK_NULL_HANDLE;
+   VkDescriptorSet bound_set = VK_NULL_HANDLE;
+   uint32_t first = 0;
+   for (uint32_t i = 1; i <= data->quads.size(); i++) {
+      const overlay_quad &quad = data->quads[first];
+      if (i < data->quads.size() && !quad.desc && !data->quads[i].desc &&
+          data->quads[i].premultiplied == quad.premultiplied)
+         continue;
+      VkPipeline pipeline;
+      VkPipelineLayout layout;
+      VkDescriptorSet set;
+      if (quad.desc) {
+         pipeline = quad.premultiplied ? data->pipelines->image_pipeline_premultiplied : data->pipelines->image_pipeline;
+         layout = device_data->pipeline_layout;
+         set = quad.desc;
+      } else {
+         pipeline = quad.premultiplied ? data->pipelines->bindless_pipeline_premultiplied : data->pipelines->bindless_pipeline;
+         layout = device_data->bindless_pipeline_layout;
+         set = device_data->bindless_set;
+      }
+      if (pipeline != bound_pipeline) {
+         device_data->vtable.CmdBindPipeline(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+         bound_pipeline = pipeline;
+      }
+      if (set != bound_set) {
+         device_data->vtable.CmdBindDescriptorSets(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                                   layout, 0, 1, &set, 0, NULL);
+         bound_set = set;
+      }
+      device_data->vtable.CmdDraw(draw->command_buffer, 4, i - first, 0, first);
+      first = i;
    }
+}
+
+/* Draws HUD content, overlay images do not go through ImGui */
+static void render_imgui_draw_data(struct swapchain_data *data,
+                                   struct overlay_draw *draw,
+                                   ImDrawData *draw_data,
+                                   VkDeviceSize vertex_offset,
+                                   VkDeviceSize index_offset)
+{
+   struct device_data *device_data = data->device;
+   const struct overlay_ring_alloc &alloc = draw->vertex_alloc;
 
    /* Upload vertex & index data */
-   ImDrawVert* vtx_dst = NULL;
-   ImDrawIdx* idx_dst = NULL;
-   VK_CHECK(device_data->vtable.MapMemory(device_data->device, draw->vertex_buffer_mem,
-                                          0, draw->vertex_buffer_size, 0, (void**)(&vtx_dst)));
-   VK_CHECK(device_data->vtable.MapMemory(device_data->device, draw->index_buffer_mem,
-                                          0, draw->index_buffer_size, 0, (void**)(&idx_dst)));
+   ImDrawVert* vtx_dst = (ImDrawVert*)(alloc.ring->map + alloc.offset + vertex_offset);
+   ImDrawIdx* idx_dst = (ImDrawIdx*)(alloc.ring->map + alloc.offset + index_offset);
 
    for (int n = 0; n < draw_data->CmdListsCount; n++)
       {
@@ -1084,55 +2433,14 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
          vtx_dst += cmd_list->VtxBuffer.Size;
          idx_dst += cmd_list->IdxBuffer.Size;
       }
-   VkMappedMemoryRange range[2] = {};
-   range[0].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-   range[0].memory = draw->vertex_buffer_mem;
-   range[0].size = VK_WHOLE_SIZE;
-   range[1].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-   range[1].memory = draw->index_buffer_mem;
-   range[1].size = VK_WHOLE_SIZE;
-   VK_CHECK(device_data->vtable.FlushMappedMemoryRanges(device_data->device, 2, range));
-   device_data->vtable.UnmapMemory(device_data->device, draw->vertex_buffer_mem);
-   device_data->vtable.UnmapMemory(device_data->device, draw->index_buffer_mem);
 
    /* Bind pipeline and descriptor sets */
-   device_data->vtable.CmdBindPipeline(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, data->pipeline);
+   device_data->vtable.CmdBindPipeline(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, data->pipelines->pipeline);
 
    /* Bind vertex & index buffers */
-   VkBuffer vertex_buffers[1] = { draw->vertex_buffer };
-   VkDeviceSize vertex_offset[1] = { 0 };
-   device_data->vtable.CmdBindVertexBuffers(draw->command_buffer, 0, 1, vertex_buffers, vertex_offset);
-   device_data->vtable.CmdBindIndexBuffer(draw->command_buffer, draw->index_buffer, 0, VK_INDEX_TYPE_UINT16);
-
-   /* Setup viewport */
-   VkViewport viewport;
-   viewport.x = 0;
-   viewport.y = 0;
-   viewport.width = draw_data->DisplaySize.x;
-   viewport.height = draw_data->DisplaySize.y;
-   viewport.minDepth = 0.0f;
-   viewport.maxDepth = 1.0f;
-   device_data->vtable.CmdSetViewport(draw->command_buffer, 0, 1, &viewport);
-
-
-   /* Setup scale and translation through push constants :
-   *
-   * Our visible imgui space lies from draw_data->DisplayPos (top left) to
-   * draw_data->DisplayPos+data_data->DisplaySize (bottom right). DisplayMin
-   * is typically (0,0) for single viewport apps.
-   */
-   float scale[2];
-   scale[0] = 2.0f / draw_data->DisplaySize.x;
-   scale[1] = 2.0f / draw_data->DisplaySize.y;
-   float translate[2];
-   translate[0] = -1.0f - draw_data->DisplayPos.x * scale[0];
-   translate[1] = -1.0f - draw_data->DisplayPos.y * scale[1];
-   device_data->vtable.CmdPushConstants(draw->command_buffer, data->pipeline_layout,
-                                       VK_SHADER_STAGE_VERTEX_BIT,
-                                       sizeof(float) * 0, sizeof(float) * 2, scale);
-   device_data->vtable.CmdPushConstants(draw->command_buffer, data->pipeline_layout,
-                                       VK_SHADER_STAGE_VERTEX_BIT,
-                                       sizeof(float) * 2, sizeof(float) * 2, translate);
+   VkDeviceSize vertex_buffer_offset = alloc.offset + vertex_offset;
+   device_data->vtable.CmdBindVertexBuffers(draw->command_buffer, 0, 1, &alloc.ring->buffer, &vertex_buffer_offset);
+   device_data->vtable.CmdBindIndexBuffer(draw->command_buffer, alloc.ring->buffer, alloc.offset + index_offset, VK_INDEX_TYPE_UINT16);
 
    // Render the command lists:
    int vtx_offset = 0;
@@ -1155,7 +2463,7 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
 
          VkDescriptorSet desc_set[1] = { (VkDescriptorSet)pcmd->TextureId };
          device_data->vtable.CmdBindDescriptorSets(draw->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                                   data->pipeline_layout, 0, 1, desc_set, 0, NULL);
+                                                   device_data->pipeline_layout, 0, 1, desc_set, 0, NULL);
 
          // Draw
          device_data->vtable.CmdDrawIndexed(draw->command_buffer, pcmd->ElemCount, 1, idx_offset, vtx_offset, 0);
@@ -1164,6 +2472,141 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
       }
       vtx_offset += cmd_list->VtxBuffer.Size;
    }
+}
+
+#ifdef VK_KHR_dynamic_rendering
+/* Layout change, and queue family transfer when presenting from another
+ * family, of the swapchain image around dynamic rendering
+ */
+static void swapchain_image_barrier(struct swapchain_data *data,
+                                    struct overlay_draw *draw,
+                                    struct queue_data *present_queue,
+                                    unsigned image_index,
+                                    bool acquire)
+{
+   struct device_data *device_data = data->device;
+
+   VkImageMemoryBarrier2KHR imb = {};
+   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+   if (acquire) {
+      /* Waited on by the submit, only the layout change has to come
+       * before our attachment loads
+       */
+      imb.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR;
+      imb.srcAccessMask = VK_ACCESS_2_NONE_KHR;
+      imb.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR;
+      imb.dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT_KHR |
+         VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR;
+      imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+      imb.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      imb.srcQueueFamilyIndex = present_queue->family_index;
+      imb.dstQueueFamilyIndex = device_data->graphic_queue->family_index;
+   } else {
+      /* Present waits on our semaphore */
+      imb.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR;
+      imb.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR;
+      imb.dstStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+      imb.dstAccessMask = VK_ACCESS_2_NONE_KHR;
+      imb.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      imb.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+      imb.srcQueueFamilyIndex = device_data->graphic_queue->family_index;
+      imb.dstQueueFamilyIndex = present_queue->family_index;
+   }
+   imb.image = data->images[image_index];
+   imb.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+   VkDependencyInfoKHR dep_info = {};
+   dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+   dep_info.imageMemoryBarrierCount = 1;
+   dep_info.pImageMemoryBarriers = &imb;
+   device_data->CmdPipelineBarrier2KHR(draw->command_buffer, &dep_info);
+}
+#endif
+
+static void begin_overlay_pass(struct swapchain_data *data,
+                               struct overlay_draw *draw,
+                               struct queue_data *present_queue,
+                               unsigned image_index)
+{
+   struct device_data *device_data = data->device;
+
+#ifdef VK_KHR_dynamic_rendering
+   if (device_data->dynamic_rendering) {
+      swapchain_image_barrier(data, draw, present_queue, image_index, true);
+
+      VkRenderingAttachmentInfoKHR color_attachment = {};
+      color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+      color_attachment.imageView = data->image_views[image_index];
+      color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+      color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+      VkRenderingInfoKHR rendering_info = {};
+      rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+      rendering_info.renderArea.extent.width = data->width;
+      rendering_info.renderArea.extent.height = data->height;
+      rendering_info.layerCount = 1;
+      rendering_info.colorAttachmentCount = 1;
+      rendering_info.pColorAttachments = &color_attachment;
+      device_data->CmdBeginRenderingKHR(draw->command_buffer, &rendering_info);
+      return;
+   }
+#endif
+
+   VkRenderPassBeginInfo render_pass_info = {};
+   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+   render_pass_info.renderPass = data->pipelines->render_pass;
+   render_pass_info.framebuffer = data->framebuffers[image_index];
+   render_pass_info.renderArea.extent.width = data->width;
+   render_pass_info.renderArea.extent.height = data->height;
+
+   /* Bounce the image to display back to color attachment layout for
+    * rendering on top of it.
+    */
+   VkImageMemoryBarrier imb;
+   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+   imb.pNext = nullptr;
+   imb.srcAccessMask = 0;
+   imb.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+      VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+   imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+   imb.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+   imb.image = data->images[image_index];
+   imb.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   imb.subresourceRange.baseMipLevel = 0;
+   imb.subresourceRange.levelCount = 1;
+   imb.subresourceRange.baseArrayLayer = 0;
+   imb.subresourceRange.layerCount = 1;
+   imb.srcQueueFamilyIndex = present_queue->family_index;
+   imb.dstQueueFamilyIndex = device_data->graphic_queue->family_index;
+   /* The submit waits for the image at color attachment output, so
+    * that's all the transition has to come after.
+    */
+   device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
+                                          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                          0,          /* dependency flags */
+                                          0, nullptr, /* memory barriers */
+                                          0, nullptr, /* buffer memory barriers */
+                                          1, &imb);   /* image memory barriers */
+
+   device_data->vtable.CmdBeginRenderPass(draw->command_buffer, &render_pass_info,
+                                          VK_SUBPASS_CONTENTS_INLINE);
+}
+
+static void end_overlay_pass(struct swapchain_data *data,
+                             struct overlay_draw *draw,
+                             struct queue_data *present_queue,
+                             unsigned image_index)
+{
+   struct device_data *device_data = data->device;
+
+#ifdef VK_KHR_dynamic_rendering
+   if (device_data->dynamic_rendering) {
+      device_data->CmdEndRenderingKHR(draw->command_buffer);
+      swapchain_image_barrier(data, draw, present_queue, image_index, false);
+      return;
+   }
+#endif
 
    device_data->vtable.CmdEndRenderPass(draw->command_buffer);
 
@@ -1172,10 +2615,11 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
       /* Transfer the image back to the present queue family
        * image layout was already changed to present by the render pass
        */
+      VkImageMemoryBarrier imb;
       imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
       imb.pNext = nullptr;
       imb.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-      imb.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      imb.dstAccessMask = 0;
       imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
       imb.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
       imb.image = data->images[image_index];
@@ -1186,61 +2630,396 @@ static struct overlay_draw *render_swapchain_display(struct swapchain_data *data
       imb.subresourceRange.layerCount = 1;
       imb.srcQueueFamilyIndex = device_data->graphic_queue->family_index;
       imb.dstQueueFamilyIndex = present_queue->family_index;
+      /* Present waits on our semaphore, nothing after us to block */
       device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
-                                             VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
-                                             VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT,
+                                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
                                              0,          /* dependency flags */
                                              0, nullptr, /* memory barriers */
                                              0, nullptr, /* buffer memory barriers */
                                              1, &imb);   /* image memory barriers */
    }
+}
+
+static void record_swapchain_display(struct swapchain_data *data,
+                                     struct overlay_draw *draw,
+                                     ImDrawData *draw_data,
+                                     struct queue_data *present_queue,
+                                     unsigned image_index)
+{
+   struct device_data *device_data = data->device;
+
+   device_data->vtable.ResetCommandBuffer(draw->command_buffer, 0);
+
+   VkCommandBufferBeginInfo buffer_begin_info = {};
+   buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+   device_data->vtable.BeginCommandBuffer(draw->command_buffer, &buffer_begin_info);
+
+   begin_overlay_pass(data, draw, present_queue, image_index);
+
+   /* Setup viewport */
+   VkViewport viewport;
+   viewport.x = 0;
+   viewport.y = 0;
+   viewport.width = data->width;
+   viewport.height = data->height;
+   viewport.minDepth = 0.0f;
+   viewport.maxDepth = 1.0f;
+   device_data->vtable.CmdSetViewport(draw->command_buffer, 0, 1, &viewport);
+
+   /* Setup scale and translation through push constants, mapping the
+    * swapchain extent in pixels to [-1,1]
+    */
+   float scale[2];
+   scale[0] = 2.0f / data->width;
+   scale[1] = 2.0f / data->height;
+   float translate[2];
+   translate[0] = -1.0f;
+   translate[1] = -1.0f;
+   device_data->vtable.CmdPushConstants(draw->command_buffer, device_data->pipeline_layout,
+                                       VK_SHADER_STAGE_VERTEX_BIT,
+                                       sizeof(float) * 0, sizeof(float) * 2, scale);
+   device_data->vtable.CmdPushConstants(draw->command_buffer, device_data->pipeline_layout,
+                                       VK_SHADER_STAGE_VERTEX_BIT,
+                                       sizeof(float) * 2, sizeof(float) * 2, translate);
+
+   /* The draw's previous data was only used by its previous recording */
+   ring_release(device_data, draw->vertex_alloc);
+   const VkDeviceSize instance_size = data->quads.size() * sizeof(overlay_instance);
+   const VkDeviceSize vertex_offset = (instance_size + 15) & ~15;
+   const VkDeviceSize vertex_size = draw_data ? draw_data->TotalVtxCount * sizeof(ImDrawVert) : 0;
+   const VkDeviceSize index_offset = vertex_offset + ((vertex_size + 15) & ~15);
+   const VkDeviceSize index_size = draw_data ? draw_data->TotalIdxCount * sizeof(ImDrawIdx) : 0;
+   ring_alloc(device_data, &device_data->vertex_rings, index_offset + index_size, draw->vertex_alloc);
+
+   if (!data->quads.empty())
+      render_image_quads(data, draw, 0);
+   if (draw_data)
+      render_imgui_draw_data(data, draw, draw_data, vertex_offset, index_offset);
+   ring_flush(device_data, draw->vertex_alloc);
+
+   end_overlay_pass(data, draw, present_queue, image_index);
+
+   device_data->vtable.EndCommandBuffer(draw->command_buffer);
+}
+
+/* Blends the image quads into the tiles of the swapchain image they cover,
+ * in a single dispatch
+ */
+static void record_swapchain_compute(struct swapchain_data *data,
+                                     struct overlay_draw *draw,
+                                     struct queue_data *present_queue,
+                                     unsigned image_index)
+{
+   struct device_data *device_data = data->device;
+
+   device_data->vtable.ResetCommandBuffer(draw->command_buffer, 0);
+
+   VkCommandBufferBeginInfo buffer_begin_info = {};
+   buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+   device_data->vtable.BeginCommandBuffer(draw->command_buffer, &buffer_begin_info);
+
+   /* Tiles covered by any quad, in row order */
+   const uint32_t tiles_x = (data->width + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE;
+   const uint32_t tiles_y = (data->height + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE;
+   data->covered_tiles.assign(tiles_x * tiles_y, false);
+   for (const overlay_quad &quad : data->quads) {
+      const float *rect = quad.instance.rect;
+      const int x0 = std::max(0, (int)std::floor(rect[0]));
+      const int y0 = std::max(0, (int)std::floor(rect[1]));
+      const int x1 = std::min((int)data->width, (int)std::ceil(rect[0] + rect[2]));
+      const int y1 = std::min((int)data->height, (int)std::ceil(rect[1] + rect[3]));
+      if (x0 >= x1 || y0 >= y1)
+         continue;
+      for (int y = y0 / OVERLAY_TILE_SIZE; y <= (y1 - 1) / OVERLAY_TILE_SIZE; y++) {
+         for (int x = x0 / OVERLAY_TILE_SIZE; x <= (x1 - 1) / OVERLAY_TILE_SIZE; x++)
+            data->covered_tiles[y * tiles_x + x] = true;
+      }
+   }
+   data->tiles.clear();
+   for (uint32_t i = 0; i < data->covered_tiles.size(); i++) {
+      if (data->covered_tiles[i])
+         data->tiles.push_back((i / tiles_x) << 16 | (i % tiles_x));
+   }
+
+   /* Instances with the blend mode in the texture's top bit, then tiles */
+   ring_release(device_data, draw->vertex_alloc);
+   const VkDeviceSize instance_size = data->quads.size() * sizeof(overlay_instance);
+   const VkDeviceSize tiles_offset = (instance_size + 15) & ~15;
+   uint8_t *map = ring_alloc(device_data, &device_data->vertex_rings,
+                             tiles_offset + data->tiles.size() * sizeof(uint32_t), draw->vertex_alloc);
+   overlay_instance *instance_dst = (overlay_instance *)map;
+   for (const overlay_quad &quad : data->quads) {
+      *instance_dst = quad.instance;
+      if (quad.premultiplied)
+         instance_dst->texture |= 0x80000000u;
+      instance_dst++;
+   }
+   memcpy(map + tiles_offset, data->tiles.data(), data->tiles.size() * sizeof(uint32_t));
+   ring_flush(device_data, draw->vertex_alloc);
+
+   VkDescriptorImageInfo target_info = {};
+   target_info.imageView = data->image_views[image_index];
+   target_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+   VkDescriptorBufferInfo data_info = {};
+   data_info.buffer = draw->vertex_alloc.ring->buffer;
+   data_info.offset = 0;
+   data_info.range = VK_WHOLE_SIZE;
+   VkWriteDescriptorSet write_desc[2] = {};
+   write_desc[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+   write_desc[0].dstSet = draw->compute_set;
+   write_desc[0].dstBinding = 0;
+   write_desc[0].descriptorCount = 1;
+   write_desc[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+   write_desc[0].pImageInfo = &target_info;
+   write_desc[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+   write_desc[1].dstSet = draw->compute_set;
+   write_desc[1].dstBinding = 1;
+   write_desc[1].descriptorCount = 1;
+   write_desc[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+   write_desc[1].pBufferInfo = &data_info;
+   device_data->vtable.UpdateDescriptorSets(device_data->device, 2, write_desc, 0, NULL);
+
+   /* The submit waits for the image at the compute stage */
+   VkImageMemoryBarrier imb = {};
+   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+   imb.srcAccessMask = 0;
+   imb.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+   imb.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+   imb.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+   imb.srcQueueFamilyIndex = present_queue->family_index;
+   imb.dstQueueFamilyIndex = device_data->graphic_queue->family_index;
+   imb.image = data->images[image_index];
+   imb.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+   device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
+                                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                          0, 0, NULL, 0, NULL, 1, &imb);
+
+   if (!data->tiles.empty()) {
+      VkDescriptorSet sets[2] = { device_data->bindless_set, draw->compute_set };
+      device_data->vtable.CmdBindPipeline(draw->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                          device_data->compute_pipeline);
+      device_data->vtable.CmdBindDescriptorSets(draw->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                                device_data->compute_pipeline_layout, 0, 2, sets, 0, NULL);
+      /* Offsets in uints, ring allocations are 16 byte aligned */
+      uint32_t constants[4];
+      constants[0] = draw->vertex_alloc.offset / sizeof(uint32_t);
+      constants[1] = data->quads.size();
+      constants[2] = (draw->vertex_alloc.offset + tiles_offset) / sizeof(uint32_t);
+      constants[3] = data->tiles.size();
+      device_data->vtable.CmdPushConstants(draw->command_buffer, device_data->compute_pipeline_layout,
+                                           VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), constants);
+      /* Rows of workgroups when tiles exceed the x limit */
+      const uint32_t n_tiles = data->tiles.size();
+      const uint32_t groups_x = std::min(n_tiles, device_data->properties.limits.maxComputeWorkGroupCount[0]);
+      device_data->vtable.CmdDispatch(draw->command_buffer, groups_x, (n_tiles + groups_x - 1) / groups_x, 1);
+   }
+
+   /* Present waits on our semaphore */
+   imb.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+   imb.dstAccessMask = 0;
+   imb.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+   imb.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+   imb.srcQueueFamilyIndex = device_data->graphic_queue->family_index;
+   imb.dstQueueFamilyIndex = present_queue->family_index;
+   device_data->vtable.CmdPipelineBarrier(draw->command_buffer,
+                                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                          VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                          0, 0, NULL, 0, NULL, 1, &imb);
 
    device_data->vtable.EndCommandBuffer(draw->command_buffer);
+}
+
+/* Waits until at most max_frames_in_flight - 1 draws of the swapchain are
+ * left on the GPU, so there's room for the next one. Without timeline
+ * semaphores the draws' fences only bound reuse.
+ */
+static void wait_frames_in_flight(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
+   if (!device_data->timeline_semaphore)
+      return;
+
+   uint64_t completed;
+   VK_CHECK(device_data->vtable.GetSemaphoreCounterValueKHR(device_data->device,
+                                                            device_data->draw_timeline,
+                                                            &completed));
+   while (!data->draws_in_flight.empty() && data->draws_in_flight.front() <= completed)
+      data->draws_in_flight.pop_front();
+
+   const size_t max_frames = std::max(device_data->instance->params.max_frames_in_flight, 1u);
+   if (data->draws_in_flight.size() < max_frames)
+      return;
+
+   const size_t n_done = data->draws_in_flight.size() - max_frames + 1;
+   uint64_t value = data->draws_in_flight[n_done - 1];
+   VkSemaphoreWaitInfoKHR wait_info = {};
+   wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+   wait_info.semaphoreCount = 1;
+   wait_info.pSemaphores = &device_data->draw_timeline;
+   wait_info.pValues = &value;
+   VK_CHECK(device_data->vtable.WaitSemaphoresKHR(device_data->device, &wait_info, UINT64_MAX));
+   data->draws_in_flight.erase(data->draws_in_flight.begin(),
+                               data->draws_in_flight.begin() + n_done);
+}
+
+static struct overlay_draw *render_swapchain_display(struct swapchain_data *data,
+                                                     struct queue_data *present_queue,
+                                                     const VkSemaphore *wait_semaphores,
+                                                     unsigned n_wait_semaphores,
+                                                     unsigned image_index)
+{
+   /* NULL without HUD output */
+   ImDrawData* draw_data = data->hud ? ImGui::GetDrawData() : NULL;
+   if (draw_data && draw_data->TotalVtxCount == 0)
+      draw_data = NULL;
+   if (data->quads.empty() && !draw_data)
+      return NULL;
+
+   struct device_data *device_data = data->device;
+   struct overlay_draw *draw = get_overlay_draw(data, image_index);
+   if (!draw)
+      return NULL;
+
+   /* Copies go to their own command buffer, so the draw can be reused
+    * while only image contents change
+    */
+   VkCommandBufferBeginInfo upload_begin_info = {};
+   upload_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+   upload_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+   device_data->vtable.ResetCommandBuffer(draw->upload_command_buffer, 0);
+   device_data->vtable.BeginCommandBuffer(draw->upload_command_buffer, &upload_begin_info);
+   bool uploads = false;
+   if (draw_data)
+      uploads |= ensure_swapchain_fonts(data, draw);
+   uploads |= ensure_swapchain_images(data, draw);
+   device_data->vtable.EndCommandBuffer(draw->upload_command_buffer);
+
+   uint32_t n_acquire_semaphores;
+   import_acquire_fences(data, draw, &n_acquire_semaphores);
+   VkSemaphore signal_semaphores[2] = { draw->semaphore };
+   uint32_t n_signal_semaphores = 1;
+
+   /* ImGui output needs rasterization, only image quads are composited
+    * with compute
+    */
+   bool compute = data->compute && !draw_data;
+   for (const overlay_quad &quad : data->quads)
+      compute &= !quad.desc; // overlay.comp only samples the bindless array
+   const VkPipelineStageFlags target_stage = compute ?
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+   /* Recorded again only when the scene changed, ImGui output is never
+    * cached.
+    */
+   if (draw->recorded_image != (int)image_index ||
+       draw->recorded_generation != data->snapshot->generation ||
+       draw->recorded_swaps != device_data->texture_swaps ||
+       draw->recorded_family != present_queue->family_index ||
+       draw_data) {
+      if (compute)
+         record_swapchain_compute(data, draw, present_queue, image_index);
+      else
+         record_swapchain_display(data, draw, draw_data, present_queue, image_index);
+      draw->recorded_image = draw_data ? -1 : (int)image_index;
+      draw->recorded_generation = data->snapshot->generation;
+      draw->recorded_swaps = device_data->texture_swaps;
+      draw->recorded_family = present_queue->family_index;
+   }
+   VkCommandBuffer command_buffers[2] = { draw->upload_command_buffer, draw->command_buffer };
+   const uint32_t n_command_buffers = uploads ? 2 : 1;
+   const VkCommandBuffer *submit_command_buffers = command_buffers + 2 - n_command_buffers;
 
-   /* When presenting on a different queue than where we're drawing the
-    * overlay *AND* when the application does not provide a semaphore to
-    * vkQueuePresent, insert our own cross engine synchronization
-    * semaphore.
+   /* Draw on the present queue when it can run our commands, so presenting
+    * needs nothing from another queue.
     */
-   if (n_wait_semaphores == 0 && device_data->graphic_queue->queue != present_queue->queue) {
-      VkPipelineStageFlags stages_wait = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+   struct queue_data *draw_queue =
+      present_queue->family_index == device_data->graphic_queue->family_index ?
+      present_queue : device_data->graphic_queue;
+
+   std::vector<VkSemaphore> &waits = data->submit_waits;
+   std::vector<VkPipelineStageFlags> &stages_wait = data->submit_wait_stages;
+   std::vector<uint64_t> &wait_values = data->submit_wait_values;
+   waits.clear();
+   stages_wait.clear();
+   wait_values.clear();
+
+   if (n_wait_semaphores == 0 && draw_queue->queue != present_queue->queue) {
+      /* Present only queue family and no semaphore from the application,
+       * only an empty submit orders the app's work before ours.
+       */
       VkSubmitInfo submit_info = {};
       submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-      submit_info.commandBufferCount = 0;
-      submit_info.pWaitDstStageMask = &stages_wait;
-      submit_info.waitSemaphoreCount = 0;
       submit_info.signalSemaphoreCount = 1;
       submit_info.pSignalSemaphores = &draw->cross_engine_semaphore;
 
       device_data->vtable.QueueSubmit(present_queue->queue, 1, &submit_info, VK_NULL_HANDLE);
 
-      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-      submit_info.commandBufferCount = 1;
-      submit_info.pWaitDstStageMask = &stages_wait;
-      submit_info.pCommandBuffers = &draw->command_buffer;
-      submit_info.waitSemaphoreCount = 1;
-      submit_info.pWaitSemaphores = &draw->cross_engine_semaphore;
-      submit_info.signalSemaphoreCount = 1;
-      submit_info.pSignalSemaphores = &draw->semaphore;
-
-      device_data->vtable.QueueSubmit(device_data->graphic_queue->queue, 1, &submit_info, draw->fence);
+      waits.push_back(draw->cross_engine_semaphore);
    } else {
-      // wait in the fragment stage until the swapchain image is ready
-      std::vector<VkPipelineStageFlags> stages_wait(n_wait_semaphores, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+      // the swapchain image is only touched by attachment loads and stores
+      // or the composite
+      waits.assign(wait_semaphores, wait_semaphores + n_wait_semaphores);
+   }
+   stages_wait.resize(waits.size(), target_stage);
 
-      VkSubmitInfo submit_info = {};
-      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-      submit_info.commandBufferCount = 1;
-      submit_info.pCommandBuffers = &draw->command_buffer;
-      submit_info.pWaitDstStageMask = stages_wait.data();
-      submit_info.waitSemaphoreCount = n_wait_semaphores;
-      submit_info.pWaitSemaphores = wait_semaphores;
-      submit_info.signalSemaphoreCount = 1;
-      submit_info.pSignalSemaphores = &draw->semaphore;
+   /* Client acquire fences guard sampling dmabufs and copies from imported shm */
+   waits.insert(waits.end(), draw->acquire_semaphores.begin(), draw->acquire_semaphores.begin() + n_acquire_semaphores);
+   stages_wait.resize(waits.size(), VK_PIPELINE_STAGE_TRANSFER_BIT | device_data->sample_stages);
 
-      device_data->vtable.QueueSubmit(device_data->graphic_queue->queue, 1, &submit_info, draw->fence);
+   /* Every draw signals draw_timeline. Async uploads wait on it before
+    * overwriting images, and draws wait for an upload only when an image
+    * has nothing older to sample.
+    */
+   VkSubmitInfo submit_info = {};
+   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+   VkTimelineSemaphoreSubmitInfoKHR timeline_info = {};
+   uint64_t signal_values[2] = {};
+   if (device_data->timeline_semaphore) {
+      wait_values.resize(waits.size()); // ignored for binary semaphores
+      if (device_data->draw_wait) {
+         waits.push_back(device_data->upload_timeline);
+         stages_wait.push_back(device_data->sample_stages);
+         wait_values.push_back(device_data->draw_wait_value);
+      }
+      /* Values must increase in the order they are signaled, which only
+       * submission order on one queue guarantees
+       */
+      if (device_data->draw_queue && device_data->draw_queue != draw_queue->queue) {
+         waits.push_back(device_data->draw_timeline);
+         stages_wait.push_back(target_stage);
+         wait_values.push_back(device_data->draw_value);
+      }
+      device_data->draw_queue = draw_queue->queue;
+      signal_semaphores[n_signal_semaphores] = device_data->draw_timeline;
+      signal_values[n_signal_semaphores++] = ++device_data->draw_value;
+
+      timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+      timeline_info.waitSemaphoreValueCount = wait_values.size();
+      timeline_info.pWaitSemaphoreValues = wait_values.data();
+      timeline_info.signalSemaphoreValueCount = n_signal_semaphores;
+      timeline_info.pSignalSemaphoreValues = signal_values;
+      submit_info.pNext = &timeline_info;
+   } else {
+      draw->value = ++device_data->draw_value;
+      device_data->draws_pending.insert(draw->value);
    }
 
+   submit_info.commandBufferCount = n_command_buffers;
+   submit_info.pCommandBuffers = submit_command_buffers;
+   submit_info.pWaitDstStageMask = stages_wait.data();
+   submit_info.waitSemaphoreCount = waits.size();
+   submit_info.pWaitSemaphores = waits.data();
+   submit_info.signalSemaphoreCount = n_signal_semaphores;
+   submit_info.pSignalSemaphores = signal_semaphores;
+
+   device_data->vtable.QueueSubmit(draw_queue->queue, 1, &submit_info, draw->fence);
+   if (device_data->timeline_semaphore)
+      data->draws_in_flight.push_back(device_data->draw_value);
+
    return draw;
 }
 
@@ -1250,102 +3029,157 @@ static const uint32_t overlay_vert_spv[] = {
 static const uint32_t overlay_frag_spv[] = {
 #include "overlay.frag.spv.h"
 };
+static const uint32_t overlay_bindless_vert_spv[] = {
+#include "overlay.vert.bindless.spv.h"
+};
+static const uint32_t overlay_bindless_frag_spv[] = {
+#include "overlay.frag.bindless.spv.h"
+};
+static const uint32_t overlay_comp_spv[] = {
+#include "overlay.comp.spv.h"
+};
 
-static void setup_swapchain_data_pipeline(struct swapchain_data *data)
+/* Formats most swapchains use, compiled ahead on device creation */
+static const VkFormat overlay_precompiled_formats[] = {
+   VK_FORMAT_B8G8R8A8_UNORM,
+   VK_FORMAT_B8G8R8A8_SRGB,
+   VK_FORMAT_R8G8B8A8_UNORM,
+   VK_FORMAT_R8G8B8A8_SRGB,
+   VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+};
+
+/* $XDG_CACHE_HOME/imgoverlay/<pipelineCacheUUID>.bin */
+static std::string pipeline_cache_path(struct device_data *device_data)
 {
-   struct device_data *device_data = data->device;
-   VkShaderModule vert_module, frag_module;
+   std::string dir = get_cache_dir();
+   if (dir.empty())
+      return dir;
+   char uuid[VK_UUID_SIZE * 2 + 1];
+   for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+      snprintf(uuid + i * 2, 3, "%02x", device_data->properties.pipelineCacheUUID[i]);
+   return dir + "/imgoverlay/" + uuid + ".bin";
+}
 
-   /* Create shader modules */
-   VkShaderModuleCreateInfo vert_info = {};
-   vert_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-   vert_info.codeSize = sizeof(overlay_vert_spv);
-   vert_info.pCode = overlay_vert_spv;
-   VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
-                                                   &vert_info, NULL, &vert_module));
-   VkShaderModuleCreateInfo frag_info = {};
-   frag_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-   frag_info.codeSize = sizeof(overlay_frag_spv);
-   frag_info.pCode = (uint32_t*)overlay_frag_spv;
-   VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
-                                                   &frag_info, NULL, &frag_module));
+static void load_pipeline_cache(struct device_data *device_data)
+{
+   /* Header is VkPipelineCacheHeaderVersionOne, data of another driver
+    * version or device is dropped
+    */
+   std::vector<char> cache_data;
+   const std::string path = pipeline_cache_path(device_data);
+   if (!path.empty() && read_file(path, cache_data) && cache_data.size() >= 16 + VK_UUID_SIZE) {
+      uint32_t header[4];
+      memcpy(header, cache_data.data(), sizeof(header));
+      if (header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+          header[2] != device_data->properties.vendorID ||
+          header[3] != device_data->properties.deviceID ||
+          memcmp(cache_data.data() + 16, device_data->properties.pipelineCacheUUID, VK_UUID_SIZE))
+         cache_data.clear();
+   } else {
+      cache_data.clear();
+   }
 
-   /* Font sampler */
-   VkSamplerCreateInfo sampler_info = {};
-   sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-   sampler_info.magFilter = VK_FILTER_NEAREST;
-   sampler_info.minFilter = VK_FILTER_NEAREST;
-   sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
-   sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-   sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-   sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-   sampler_info.minLod = -1000;
-   sampler_info.maxLod = 1000;
-   sampler_info.maxAnisotropy = 1.0f;
-   VK_CHECK(device_data->vtable.CreateSampler(device_data->device, &sampler_info,
-                                              NULL, &data->font_sampler));
+   VkPipelineCacheCreateInfo cache_info = {};
+   cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+   cache_info.initialDataSize = cache_data.size();
+   cache_info.pInitialData = cache_data.data();
+   VK_CHECK(device_data->vtable.CreatePipelineCache(device_data->device, &cache_info,
+                                                    NULL, &device_data->pipeline_cache));
+}
 
-   /* Descriptor pool */
-   VkDescriptorPoolSize sampler_pool_size = {};
-   sampler_pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-   sampler_pool_size.descriptorCount = MAX_OVERLAY_COUNT;
-   VkDescriptorPoolCreateInfo desc_pool_info = {};
-   desc_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-   desc_pool_info.maxSets = MAX_OVERLAY_COUNT;
-   desc_pool_info.poolSizeCount = 1;
-   desc_pool_info.pPoolSizes = &sampler_pool_size;
-   desc_pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-   VK_CHECK(device_data->vtable.CreateDescriptorPool(device_data->device,
-                                                     &desc_pool_info,
-                                                     NULL, &data->descriptor_pool));
+static void save_pipeline_cache(struct device_data *device_data)
+{
+   const std::string path = pipeline_cache_path(device_data);
+   if (path.empty())
+      return;
 
-   /* Descriptor layout */
-   VkSampler sampler[1] = { data->font_sampler };
-   VkDescriptorSetLayoutBinding binding[1] = {};
-   binding[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-   binding[0].descriptorCount = 1;
-   binding[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-   binding[0].pImmutableSamplers = sampler;
-   VkDescriptorSetLayoutCreateInfo set_layout_info = {};
-   set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-   set_layout_info.bindingCount = 1;
-   set_layout_info.pBindings = binding;
-   VK_CHECK(device_data->vtable.CreateDescriptorSetLayout(device_data->device,
-                                                          &set_layout_info,
-                                                          NULL, &data->descriptor_layout));
+   size_t size = 0;
+   if (device_data->vtable.GetPipelineCacheData(device_data->device, device_data->pipeline_cache,
+                                                &size, NULL) != VK_SUCCESS || !size)
+      return;
+   std::vector<char> cache_data(size);
+   if (device_data->vtable.GetPipelineCacheData(device_data->device, device_data->pipeline_cache,
+                                                &size, cache_data.data()) != VK_SUCCESS)
+      return;
 
-   /* Constants: we are using 'vec2 offset' and 'vec2 scale' instead of a full
-    * 3d projection matrix
-    */
-   VkPushConstantRange push_constants[1] = {};
-   push_constants[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-   push_constants[0].offset = sizeof(float) * 0;
-   push_constants[0].size = sizeof(float) * 4;
-   VkPipelineLayoutCreateInfo layout_info = {};
-   layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-   layout_info.setLayoutCount = 1;
-   layout_info.pSetLayouts = &data->descriptor_layout;
-   layout_info.pushConstantRangeCount = 1;
-   layout_info.pPushConstantRanges = push_constants;
-   VK_CHECK(device_data->vtable.CreatePipelineLayout(device_data->device,
-                                                     &layout_info,
-                                                     NULL, &data->pipeline_layout));
+   if (!create_dirs(path.substr(0, path.rfind('/'))) ||
+       !write_file(path, cache_data.data(), size))
+      std::cerr << "imgoverlay: Failed to write pipeline cache " << path << std::endl;
+}
+
+static VkRenderPass create_overlay_render_pass(struct device_data *device_data, VkFormat format)
+{
+   VkAttachmentDescription attachment_desc = {};
+   attachment_desc.format = format;
+   attachment_desc.samples = VK_SAMPLE_COUNT_1_BIT;
+   attachment_desc.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+   attachment_desc.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+   attachment_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+   attachment_desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+   attachment_desc.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+   attachment_desc.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+   VkAttachmentReference color_attachment_ref = {};
+   color_attachment_ref.attachment = 0;
+   color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+   VkSubpassDescription subpass = {};
+   subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+   subpass.colorAttachmentCount = 1;
+   subpass.pColorAttachments = &color_attachment_ref;
+   VkSubpassDependency dependency = {};
+   dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+   dependency.dstSubpass = 0;
+   dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+   dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+   dependency.srcAccessMask = 0;
+   dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+   VkRenderPassCreateInfo render_pass_info = {};
+   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+   render_pass_info.attachmentCount = 1;
+   render_pass_info.pAttachments = &attachment_desc;
+   render_pass_info.subpassCount = 1;
+   render_pass_info.pSubpasses = &subpass;
+   render_pass_info.dependencyCount = 1;
+   render_pass_info.pDependencies = &dependency;
+   VkRenderPass render_pass;
+   VK_CHECK(device_data->vtable.CreateRenderPass(device_data->device,
+                                                 &render_pass_info,
+                                                 NULL, &render_pass));
+   return render_pass;
+}
+
+static struct overlay_pipelines *create_overlay_pipelines(struct device_data *device_data, VkFormat format)
+{
+   struct overlay_pipelines *pipelines = new overlay_pipelines();
+   pipelines->render_pass = VK_NULL_HANDLE;
+
+   VkGraphicsPipelineCreateInfo info = {};
+#ifdef VK_KHR_dynamic_rendering
+   VkPipelineRenderingCreateInfoKHR rendering_info = {};
+   rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+   rendering_info.colorAttachmentCount = 1;
+   rendering_info.pColorAttachmentFormats = &format;
+   if (device_data->dynamic_rendering)
+      info.pNext = &rendering_info;
+#endif
+
+   if (!device_data->dynamic_rendering)
+      pipelines->render_pass = create_overlay_render_pass(device_data, format);
 
    VkPipelineShaderStageCreateInfo stage[2] = {};
    stage[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
    stage[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-   stage[0].module = vert_module;
+   stage[0].module = device_data->vert_module;
    stage[0].pName = "main";
    stage[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
    stage[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-   stage[1].module = frag_module;
+   stage[1].module = device_data->frag_module;
    stage[1].pName = "main";
 
    VkVertexInputBindingDescription binding_desc[1] = {};
    binding_desc[0].stride = sizeof(ImDrawVert);
    binding_desc[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-   VkVertexInputAttributeDescription attribute_desc[3] = {};
+   VkVertexInputAttributeDescription attribute_desc[4] = {};
    attribute_desc[0].location = 0;
    attribute_desc[0].binding = binding_desc[0].binding;
    attribute_desc[0].format = VK_FORMAT_R32G32_SFLOAT;
@@ -1411,7 +3245,6 @@ static void setup_swapchain_data_pipeline(struct swapchain_data *data)
    dynamic_state.dynamicStateCount = (uint32_t)IM_ARRAYSIZE(dynamic_states);
    dynamic_state.pDynamicStates = dynamic_states;
 
-   VkGraphicsPipelineCreateInfo info = {};
    info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
    info.flags = 0;
    info.stageCount = 2;
@@ -1424,15 +3257,449 @@ static void setup_swapchain_data_pipeline(struct swapchain_data *data)
    info.pDepthStencilState = &depth_info;
    info.pColorBlendState = &blend_info;
    info.pDynamicState = &dynamic_state;
-   info.layout = data->pipeline_layout;
-   info.renderPass = data->render_pass;
+   info.layout = device_data->pipeline_layout;
+   info.renderPass = pipelines->render_pass;
+   VK_CHECK(
+      device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
+                                                  1, &info,
+                                                  NULL, &pipelines->pipeline));
+
+   /* Image quads, one instance per image expanded to a triangle strip in
+    * the vertex shader
+    */
+   VkBool32 image_quads = VK_TRUE;
+   VkSpecializationMapEntry spec_entry = {};
+   spec_entry.constantID = 0;
+   spec_entry.offset = 0;
+   spec_entry.size = sizeof(image_quads);
+   VkSpecializationInfo spec_info = {};
+   spec_info.mapEntryCount = 1;
+   spec_info.pMapEntries = &spec_entry;
+   spec_info.dataSize = sizeof(image_quads);
+   spec_info.pData = &image_quads;
+   stage[0].pSpecializationInfo = &spec_info;
+
+   binding_desc[0].stride = sizeof(overlay_instance);
+   binding_desc[0].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+   attribute_desc[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+   attribute_desc[0].offset = offsetof(overlay_instance, rect);
+   attribute_desc[1].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+   attribute_desc[1].offset = offsetof(overlay_instance, uv);
+   attribute_desc[2].offset = offsetof(overlay_instance, color);
+   ia_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+   VK_CHECK(
+      device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
+                                                  1, &info,
+                                                  NULL, &pipelines->image_pipeline));
+
+   /* Same for images with premultiplied alpha */
+   color_attachment[0].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+   VK_CHECK(
+      device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
+                                                  1, &info,
+                                                  NULL, &pipelines->image_pipeline_premultiplied));
+
+   pipelines->bindless_pipeline = VK_NULL_HANDLE;
+   pipelines->bindless_pipeline_premultiplied = VK_NULL_HANDLE;
+   if (!device_data->bindless)
+      return pipelines;
+
+   /* Both again, sampling the bindless array at the instance's element */
+   stage[0].module = device_data->bindless_vert_module;
+   stage[1].module = device_data->bindless_frag_module;
+   attribute_desc[3].location = 3;
+   attribute_desc[3].binding = binding_desc[0].binding;
+   attribute_desc[3].format = VK_FORMAT_R32_UINT;
+   attribute_desc[3].offset = offsetof(overlay_instance, texture);
+   vertex_info.vertexAttributeDescriptionCount = 4;
+   info.layout = device_data->bindless_pipeline_layout;
+   VK_CHECK(
+      device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
+                                                  1, &info,
+                                                  NULL, &pipelines->bindless_pipeline_premultiplied));
+   color_attachment[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
    VK_CHECK(
-      device_data->vtable.CreateGraphicsPipelines(device_data->device, VK_NULL_HANDLE,
+      device_data->vtable.CreateGraphicsPipelines(device_data->device, device_data->pipeline_cache,
                                                   1, &info,
-                                                  NULL, &data->pipeline));
+                                                  NULL, &pipelines->bindless_pipeline));
+
+   return pipelines;
+}
+
+static void destroy_overlay_pipelines(struct device_data *device_data, struct overlay_pipelines *pipelines)
+{
+   device_data->vtable.DestroyPipeline(device_data->device, pipelines->pipeline, NULL);
+   device_data->vtable.DestroyPipeline(device_data->device, pipelines->image_pipeline, NULL);
+   device_data->vtable.DestroyPipeline(device_data->device, pipelines->image_pipeline_premultiplied, NULL);
+   if (pipelines->bindless_pipeline) {
+      device_data->vtable.DestroyPipeline(device_data->device, pipelines->bindless_pipeline, NULL);
+      device_data->vtable.DestroyPipeline(device_data->device, pipelines->bindless_pipeline_premultiplied, NULL);
+   }
+   if (pipelines->render_pass)
+      device_data->vtable.DestroyRenderPass(device_data->device, pipelines->render_pass, NULL);
+   delete pipelines;
+}
+
+/* Compiled without holding pipelines_mutex, when two threads race for a
+ * format the loser's pipelines are dropped
+ */
+static struct overlay_pipelines *get_overlay_pipelines(struct device_data *device_data, VkFormat format)
+{
+   {
+      std::lock_guard<std::mutex> lock(device_data->pipelines_mutex);
+      auto it = device_data->pipelines.find(format);
+      if (it != device_data->pipelines.end())
+         return it->second;
+   }
+
+   struct overlay_pipelines *pipelines = create_overlay_pipelines(device_data, format);
+
+   std::lock_guard<std::mutex> lock(device_data->pipelines_mutex);
+   auto inserted = device_data->pipelines.insert({format, pipelines});
+   if (!inserted.second)
+      destroy_overlay_pipelines(device_data, pipelines);
+   return inserted.first->second;
+}
+
+/* Everything the pipelines of all swapchain formats share, swapchains
+ * that come and go only pick theirs from device_data::pipelines
+ */
+static void setup_device_pipeline(struct device_data *device_data)
+{
+   /* Create shader modules */
+   VkShaderModuleCreateInfo vert_info = {};
+   vert_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+   vert_info.codeSize = sizeof(overlay_vert_spv);
+   vert_info.pCode = overlay_vert_spv;
+   VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
+                                                   &vert_info, NULL, &device_data->vert_module));
+   VkShaderModuleCreateInfo frag_info = {};
+   frag_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+   frag_info.codeSize = sizeof(overlay_frag_spv);
+   frag_info.pCode = (uint32_t*)overlay_frag_spv;
+   VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
+                                                   &frag_info, NULL, &device_data->frag_module));
+
+   /* Font sampler */
+   VkSamplerCreateInfo sampler_info = {};
+   sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+   sampler_info.magFilter = VK_FILTER_NEAREST;
+   sampler_info.minFilter = VK_FILTER_NEAREST;
+   sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+   sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+   sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+   sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+   sampler_info.minLod = -1000;
+   sampler_info.maxLod = 1000;
+   sampler_info.maxAnisotropy = 1.0f;
+   VK_CHECK(device_data->vtable.CreateSampler(device_data->device, &sampler_info,
+                                              NULL, &device_data->font_sampler));
+
+   /* Descriptor layout */
+   VkSampler sampler[1] = { device_data->font_sampler };
+   VkDescriptorSetLayoutBinding binding[1] = {};
+   binding[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+   binding[0].descriptorCount = 1;
+   binding[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+   binding[0].pImmutableSamplers = sampler;
+   VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+   set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+   set_layout_info.bindingCount = 1;
+   set_layout_info.pBindings = binding;
+   VK_CHECK(device_data->vtable.CreateDescriptorSetLayout(device_data->device,
+                                                          &set_layout_info,
+                                                          NULL, &device_data->descriptor_layout));
+
+   /* Constants: we are using 'vec2 offset' and 'vec2 scale' instead of a full
+    * 3d projection matrix
+    */
+   VkPushConstantRange push_constants[1] = {};
+   push_constants[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+   push_constants[0].offset = sizeof(float) * 0;
+   push_constants[0].size = sizeof(float) * 4;
+   VkPipelineLayoutCreateInfo layout_info = {};
+   layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+   layout_info.setLayoutCount = 1;
+   layout_info.pSetLayouts = &device_data->descriptor_layout;
+   layout_info.pushConstantRangeCount = 1;
+   layout_info.pPushConstantRanges = push_constants;
+   VK_CHECK(device_data->vtable.CreatePipelineLayout(device_data->device,
+                                                     &layout_info,
+                                                     NULL, &device_data->pipeline_layout));
+
+   /* Bindless images: the sampler and an array of images, only elements
+    * of live images are written and they are updated while other elements
+    * are in use by in flight frames. Each image may hold two elements, one
+    * for the texture sampled and one for its async upload, and images
+    * destroyed keep theirs until their draws finished, so the array has
+    * room for twice that.
+    */
+   const uint32_t max_overlays = device_data->instance->params.max_overlays;
+   device_data->bindless_count = std::min(max_overlays * 4, device_data->max_bindless_images);
+   device_data->bindless = device_data->descriptor_indexing && device_data->bindless_count > 0;
+   device_data->compute_composite = device_data->bindless && device_data->storage_without_format &&
+      (device_data->graphic_queue->flags & VK_QUEUE_COMPUTE_BIT);
+   const VkShaderStageFlags bindless_stages = VK_SHADER_STAGE_FRAGMENT_BIT |
+      (device_data->compute_composite ? VK_SHADER_STAGE_COMPUTE_BIT : 0);
+   if (device_data->bindless) {
+      VkDescriptorSetLayoutBinding bindless_binding[2] = {};
+      bindless_binding[0].binding = 0;
+      bindless_binding[0].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+      bindless_binding[0].descriptorCount = 1;
+      bindless_binding[0].stageFlags = bindless_stages;
+      bindless_binding[0].pImmutableSamplers = sampler;
+      bindless_binding[1].binding = 1;
+      bindless_binding[1].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+      bindless_binding[1].descriptorCount = device_data->bindless_count;
+      bindless_binding[1].stageFlags = bindless_stages;
+      VkDescriptorBindingFlagsEXT binding_flags[2] = {
+         0,
+         VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT |
+         VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+         VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT,
+      };
+      VkDescriptorSetLayoutBindingFlagsCreateInfoEXT binding_flags_info = {};
+      binding_flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+      binding_flags_info.bindingCount = 2;
+      binding_flags_info.pBindingFlags = binding_flags;
+      VkDescriptorSetLayoutCreateInfo bindless_layout_info = {};
+      bindless_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+      bindless_layout_info.pNext = &binding_flags_info;
+      bindless_layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+      bindless_layout_info.bindingCount = 2;
+      bindless_layout_info.pBindings = bindless_binding;
+      VK_CHECK(device_data->vtable.CreateDescriptorSetLayout(device_data->device,
+                                                             &bindless_layout_info,
+                                                             NULL, &device_data->bindless_layout));
+
+      layout_info.pSetLayouts = &device_data->bindless_layout;
+      VK_CHECK(device_data->vtable.CreatePipelineLayout(device_data->device,
+                                                        &layout_info,
+                                                        NULL, &device_data->bindless_pipeline_layout));
+
+      vert_info.codeSize = sizeof(overlay_bindless_vert_spv);
+      vert_info.pCode = overlay_bindless_vert_spv;
+      VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
+                                                      &vert_info, NULL, &device_data->bindless_vert_module));
+      frag_info.codeSize = sizeof(overlay_bindless_frag_spv);
+      frag_info.pCode = overlay_bindless_frag_spv;
+      VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
+                                                      &frag_info, NULL, &device_data->bindless_frag_module));
+   }
+
+   load_pipeline_cache(device_data);
+
+   /* Compute composite: bindless images in set 0, the swapchain image and
+    * the draw's instances and tiles in set 1. Works with any storage
+    * capable swapchain format.
+    */
+   if (device_data->compute_composite) {
+      VkDescriptorSetLayoutBinding compute_binding[2] = {};
+      compute_binding[0].binding = 0;
+      compute_binding[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+      compute_binding[0].descriptorCount = 1;
+      compute_binding[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+      compute_binding[1].binding = 1;
+      compute_binding[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      compute_binding[1].descriptorCount = 1;
+      compute_binding[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+      set_layout_info.bindingCount = 2;
+      set_layout_info.pBindings = compute_binding;
+      VK_CHECK(device_data->vtable.CreateDescriptorSetLayout(device_data->device,
+                                                             &set_layout_info,
+                                                             NULL, &device_data->compute_layout));
+
+      VkDescriptorSetLayout compute_set_layouts[2] = {
+         device_data->bindless_layout, device_data->compute_layout
+      };
+      push_constants[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+      push_constants[0].size = sizeof(uint32_t) * 4;
+      layout_info.setLayoutCount = 2;
+      layout_info.pSetLayouts = compute_set_layouts;
+      VK_CHECK(device_data->vtable.CreatePipelineLayout(device_data->device,
+                                                        &layout_info,
+                                                        NULL, &device_data->compute_pipeline_layout));
+
+      VkShaderModuleCreateInfo comp_info = {};
+      comp_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+      comp_info.codeSize = sizeof(overlay_comp_spv);
+      comp_info.pCode = overlay_comp_spv;
+      VK_CHECK(device_data->vtable.CreateShaderModule(device_data->device,
+                                                      &comp_info, NULL, &device_data->compute_module));
+
+      VkComputePipelineCreateInfo compute_info = {};
+      compute_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+      compute_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+      compute_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+      compute_info.stage.module = device_data->compute_module;
+      compute_info.stage.pName = "main";
+      compute_info.layout = device_data->compute_pipeline_layout;
+      VK_CHECK(device_data->vtable.CreateComputePipelines(device_data->device, device_data->pipeline_cache,
+                                                          1, &compute_info,
+                                                          NULL, &device_data->compute_pipeline));
+      device_data->sample_stages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+   }
+
+   /* The first swapchain usually finds its pipelines ready */
+   device_data->pipeline_thread = std::thread([device_data]() {
+      for (VkFormat format : overlay_precompiled_formats) {
+         if (device_data->pipeline_thread_quit)
+            break;
+         VkFormatProperties props;
+         device_data->instance->vtable.GetPhysicalDeviceFormatProperties(device_data->physical_device,
+                                                                        format, &props);
+         if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BLEND_BIT)
+            get_overlay_pipelines(device_data, format);
+      }
+   });
+}
+
+static void destroy_device_pipeline(struct device_data *device_data)
+{
+   device_data->pipeline_thread_quit = true;
+   device_data->pipeline_thread.join();
+
+   save_pipeline_cache(device_data);
+   device_data->vtable.DestroyPipelineCache(device_data->device, device_data->pipeline_cache, NULL);
+
+   for (auto &it : device_data->pipelines)
+      destroy_overlay_pipelines(device_data, it.second);
+   device_data->pipelines.clear();
+
+   device_data->vtable.DestroyShaderModule(device_data->device, device_data->vert_module, NULL);
+   device_data->vtable.DestroyShaderModule(device_data->device, device_data->frag_module, NULL);
+   device_data->vtable.DestroyPipelineLayout(device_data->device, device_data->pipeline_layout, NULL);
+   device_data->vtable.DestroyDescriptorSetLayout(device_data->device,
+                                                  device_data->descriptor_layout, NULL);
+   if (device_data->bindless) {
+      device_data->vtable.DestroyShaderModule(device_data->device, device_data->bindless_vert_module, NULL);
+      device_data->vtable.DestroyShaderModule(device_data->device, device_data->bindless_frag_module, NULL);
+      device_data->vtable.DestroyPipelineLayout(device_data->device, device_data->bindless_pipeline_layout, NULL);
+      device_data->vtable.DestroyDescriptorSetLayout(device_data->device, device_data->bindless_layout, NULL);
+   }
+   if (device_data->compute_composite) {
+      device_data->vtable.DestroyPipeline(device_data->device, device_data->compute_pipeline, NULL);
+      device_data->vtable.DestroyShaderModule(device_data->device, device_data->compute_module, NULL);
+      device_data->vtable.DestroyPipelineLayout(device_data->device, device_data->compute_pipeline_layout, NULL);
+      device_data->vtable.DestroyDescriptorSetLayout(device_data->device, device_data->compute_layout, NULL);
+   }
+   device_data->vtable.DestroySampler(device_data->device, device_data->font_sampler, NULL);
+}
+
+/* Descriptor pools and async upload state of the overlay images */
+static void setup_device_images(struct device_data *device_data)
+{
+   /* Descriptor pool */
+   add_descriptor_pool(device_data);
+
+   if (device_data->bindless) {
+      VkDescriptorPoolSize bindless_pool_size[2] = {};
+      bindless_pool_size[0].type = VK_DESCRIPTOR_TYPE_SAMPLER;
+      bindless_pool_size[0].descriptorCount = 1;
+      bindless_pool_size[1].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+      bindless_pool_size[1].descriptorCount = device_data->bindless_count;
+      VkDescriptorPoolCreateInfo bindless_pool_info = {};
+      bindless_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+      bindless_pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+      bindless_pool_info.maxSets = 1;
+      bindless_pool_info.poolSizeCount = 2;
+      bindless_pool_info.pPoolSizes = bindless_pool_size;
+      VK_CHECK(device_data->vtable.CreateDescriptorPool(device_data->device,
+                                                        &bindless_pool_info,
+                                                        NULL, &device_data->bindless_pool));
+
+      VkDescriptorSetAllocateInfo alloc_info = {};
+      alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+      alloc_info.descriptorPool = device_data->bindless_pool;
+      alloc_info.descriptorSetCount = 1;
+      alloc_info.pSetLayouts = &device_data->bindless_layout;
+      VK_CHECK(device_data->vtable.AllocateDescriptorSets(device_data->device,
+                                                          &alloc_info,
+                                                          &device_data->bindless_set));
+      for (uint32_t i = 0; i < device_data->bindless_count; i++)
+         device_data->bindless_free.push_back(i);
+   }
+
+   /* Async uploads */
+   if (device_data->transfer_queue) {
+      VkCommandPoolCreateInfo cmd_buffer_pool_info = {};
+      cmd_buffer_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+      cmd_buffer_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+      cmd_buffer_pool_info.queueFamilyIndex = device_data->transfer_family;
+      VK_CHECK(device_data->vtable.CreateCommandPool(device_data->device,
+                                                     &cmd_buffer_pool_info,
+                                                     NULL, &device_data->transfer_command_pool));
+
+      VkSemaphoreTypeCreateInfoKHR type_info = {};
+      type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+      type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+      VkSemaphoreCreateInfo sem_info = {};
+      sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+      sem_info.pNext = &type_info;
+      VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                   NULL, &device_data->upload_timeline));
+   }
+
+   if (device_data->timeline_semaphore) {
+      VkSemaphoreTypeCreateInfoKHR type_info = {};
+      type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+      type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+      VkSemaphoreCreateInfo sem_info = {};
+      sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+      sem_info.pNext = &type_info;
+      VK_CHECK(device_data->vtable.CreateSemaphore(device_data->device, &sem_info,
+                                                   NULL, &device_data->draw_timeline));
+   }
+}
+
+static void destroy_device_images(struct device_data *device_data)
+{
+   if (device_data->transfer_queue && device_data->upload_value) {
+      VkSemaphoreWaitInfoKHR wait_info = {};
+      wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+      wait_info.semaphoreCount = 1;
+      wait_info.pSemaphores = &device_data->upload_timeline;
+      wait_info.pValues = &device_data->upload_value;
+      VK_CHECK(device_data->vtable.WaitSemaphoresKHR(device_data->device, &wait_info, UINT64_MAX));
+   }
+
+   /* Draws finished, swapchains are gone */
+   for (auto it = device_data->images.cbegin(); it != device_data->images.cend(); ++it) {
+       destroy_overlay_image(device_data, it->second);
+   }
+   device_data->images.clear();
+   for (const auto &retired : device_data->retired_images)
+       destroy_overlay_image(device_data, retired.image);
+   device_data->retired_images.clear();
+
+   if (device_data->transfer_queue) {
+      for (auto upload : device_data->uploads) {
+         release_staging(device_data, upload->staging);
+         delete upload;
+      }
+      device_data->vtable.DestroyCommandPool(device_data->device, device_data->transfer_command_pool, NULL);
+      device_data->vtable.DestroySemaphore(device_data->device, device_data->upload_timeline, NULL);
+   }
+   if (device_data->timeline_semaphore)
+      device_data->vtable.DestroySemaphore(device_data->device, device_data->draw_timeline, NULL);
+
+   for (VkDescriptorPool pool : device_data->descriptor_pools)
+      device_data->vtable.DestroyDescriptorPool(device_data->device, pool, NULL);
+   if (device_data->bindless)
+      device_data->vtable.DestroyDescriptorPool(device_data->device, device_data->bindless_pool, NULL);
+
+   if (device_data->font_image) {
+      device_data->vtable.DestroyImageView(device_data->device, device_data->font_image_view, NULL);
+      device_data->vtable.DestroyImage(device_data->device, device_data->font_image, NULL);
+      mem_free(device_data, device_data->font_mem);
+   }
+}
+
+static void setup_swapchain_data_pipeline(struct swapchain_data *data)
+{
+   struct device_data *device_data = data->device;
 
-   device_data->vtable.DestroyShaderModule(device_data->device, vert_module, NULL);
-   device_data->vtable.DestroyShaderModule(device_data->device, frag_module, NULL);
+   data->pipelines = get_overlay_pipelines(device_data, data->format);
 
    create_font(device_data->instance->params);
 
@@ -1440,12 +3707,20 @@ static void setup_swapchain_data_pipeline(struct swapchain_data *data)
    unsigned char* pixels;
    int width, height;
 
-   // upload default font to VkImage
+   /* Default font goes to a VkImage of the device, every ImGui context
+    * builds the same atlas from the same params
+    */
    io.Fonts->GetTexDataAsAlpha8(&pixels, &width, &height);
-   io.Fonts->TexID = (ImTextureID)create_image_with_desc(data, width, height, VK_FORMAT_R8_UNORM, data->font_image, data->font_mem, data->font_image_view);
+   std::lock_guard<std::mutex> lock(device_data->images_mutex);
+   if (!device_data->font_image) {
+      create_image(device_data, width, height, VK_FORMAT_R8_UNORM, device_data->font_image, device_data->font_mem, device_data->font_image_view);
+      VkDescriptorPool font_pool;
+      device_data->font_desc = alloc_image_descriptor(device_data, device_data->font_image_view, font_pool);
 #ifndef NDEBUG
-   std::cerr << "imgoverlay: Default font tex size: " << width << "x" << height << "px (" << (width*height*1) << " bytes)" << "\n";
+      std::cerr << "imgoverlay: Default font tex size: " << width << "x" << height << "px (" << (width*height*1) << " bytes)" << "\n";
 #endif
+   }
+   io.Fonts->TexID = (ImTextureID)device_data->font_desc;
 }
 
 static void setup_swapchain_data(struct swapchain_data *data,
@@ -1463,42 +3738,6 @@ static void setup_swapchain_data(struct swapchain_data *data,
 
    struct device_data *device_data = data->device;
 
-   /* Render pass */
-   VkAttachmentDescription attachment_desc = {};
-   attachment_desc.format = pCreateInfo->imageFormat;
-   attachment_desc.samples = VK_SAMPLE_COUNT_1_BIT;
-   attachment_desc.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
-   attachment_desc.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-   attachment_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-   attachment_desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-   attachment_desc.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-   attachment_desc.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-   VkAttachmentReference color_attachment = {};
-   color_attachment.attachment = 0;
-   color_attachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-   VkSubpassDescription subpass = {};
-   subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-   subpass.colorAttachmentCount = 1;
-   subpass.pColorAttachments = &color_attachment;
-   VkSubpassDependency dependency = {};
-   dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-   dependency.dstSubpass = 0;
-   dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-   dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-   dependency.srcAccessMask = 0;
-   dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-   VkRenderPassCreateInfo render_pass_info = {};
-   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-   render_pass_info.attachmentCount = 1;
-   render_pass_info.pAttachments = &attachment_desc;
-   render_pass_info.subpassCount = 1;
-   render_pass_info.pSubpasses = &subpass;
-   render_pass_info.dependencyCount = 1;
-   render_pass_info.pDependencies = &dependency;
-   VK_CHECK(device_data->vtable.CreateRenderPass(device_data->device,
-                                                 &render_pass_info,
-                                                 NULL, &data->render_pass));
-
    setup_swapchain_data_pipeline(data);
 
    uint32_t n_images = 0;
@@ -1539,17 +3778,17 @@ static void setup_swapchain_data(struct swapchain_data *data,
                                                    &data->image_views[i]));
    }
 
-   /* Framebuffers */
+   /* Framebuffers, dynamic rendering renders to the image views */
    VkImageView attachment[1];
    VkFramebufferCreateInfo fb_info = {};
    fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-   fb_info.renderPass = data->render_pass;
+   fb_info.renderPass = data->pipelines->render_pass;
    fb_info.attachmentCount = 1;
    fb_info.pAttachments = attachment;
    fb_info.width = data->width;
    fb_info.height = data->height;
    fb_info.layers = 1;
-   for (size_t i = 0; i < data->image_views.size(); i++) {
+   for (size_t i = 0; i < data->image_views.size() && !device_data->dynamic_rendering; i++) {
       attachment[0] = data->image_views[i];
       VK_CHECK(device_data->vtable.CreateFramebuffer(device_data->device, &fb_info,
                                                      NULL, &data->framebuffers[i]));
@@ -1563,20 +3802,46 @@ static void setup_swapchain_data(struct swapchain_data *data,
    VK_CHECK(device_data->vtable.CreateCommandPool(device_data->device,
                                                   &cmd_buffer_pool_info,
                                                   NULL, &data->command_pool));
+
+   /* Compute composite sets, one per draw of the bounded pool */
+   if (data->compute) {
+      const uint32_t max_draws = data->images.size() + 1;
+      VkDescriptorPoolSize compute_pool_size[2] = {};
+      compute_pool_size[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+      compute_pool_size[0].descriptorCount = max_draws;
+      compute_pool_size[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      compute_pool_size[1].descriptorCount = max_draws;
+      VkDescriptorPoolCreateInfo compute_pool_info = {};
+      compute_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+      compute_pool_info.maxSets = max_draws;
+      compute_pool_info.poolSizeCount = 2;
+      compute_pool_info.pPoolSizes = compute_pool_size;
+      VK_CHECK(device_data->vtable.CreateDescriptorPool(device_data->device,
+                                                        &compute_pool_info,
+                                                        NULL, &data->compute_pool));
+   }
 }
 
 static void shutdown_swapchain_data(struct swapchain_data *data)
 {
    struct device_data *device_data = data->device;
 
+   print_draw_stats(data);
+   {
+      std::lock_guard<std::mutex> lock(device_data->images_mutex);
+      for (auto draw : data->draws)
+         device_data->draws_pending.erase(draw->value);
+   }
    for (auto draw : data->draws) {
+      if (draw->snapshot)
+         device_data->instance->control->release(draw->snapshot);
       device_data->vtable.DestroySemaphore(device_data->device, draw->cross_engine_semaphore, NULL);
       device_data->vtable.DestroySemaphore(device_data->device, draw->semaphore, NULL);
+      for (VkSemaphore semaphore : draw->acquire_semaphores)
+         device_data->vtable.DestroySemaphore(device_data->device, semaphore, NULL);
       device_data->vtable.DestroyFence(device_data->device, draw->fence, NULL);
-      device_data->vtable.DestroyBuffer(device_data->device, draw->vertex_buffer, NULL);
-      device_data->vtable.DestroyBuffer(device_data->device, draw->index_buffer, NULL);
-      device_data->vtable.FreeMemory(device_data->device, draw->vertex_buffer_mem, NULL);
-      device_data->vtable.FreeMemory(device_data->device, draw->index_buffer_mem, NULL);
+      ring_release(device_data, draw->vertex_alloc);
+      release_staging(device_data, draw->staging);
       delete draw;
    }
 
@@ -1585,29 +3850,9 @@ static void shutdown_swapchain_data(struct swapchain_data *data)
       device_data->vtable.DestroyFramebuffer(device_data->device, data->framebuffers[i], NULL);
    }
 
-   for (auto it = data->images_data.cbegin(); it != data->images_data.cend(); ++it) {
-       destroy_swapchain_image(data, it->second);
-   }
-   data->images_data.clear();
-
-   device_data->vtable.DestroyRenderPass(device_data->device, data->render_pass, NULL);
-
    device_data->vtable.DestroyCommandPool(device_data->device, data->command_pool, NULL);
-
-   device_data->vtable.DestroyPipeline(device_data->device, data->pipeline, NULL);
-   device_data->vtable.DestroyPipelineLayout(device_data->device, data->pipeline_layout, NULL);
-
-   device_data->vtable.DestroyDescriptorPool(device_data->device,
-                                             data->descriptor_pool, NULL);
-   device_data->vtable.DestroyDescriptorSetLayout(device_data->device,
-                                                  data->descriptor_layout, NULL);
-
-   device_data->vtable.DestroySampler(device_data->device, data->font_sampler, NULL);
-   device_data->vtable.DestroyImageView(device_data->device, data->font_image_view, NULL);
-   device_data->vtable.DestroyImage(device_data->device, data->font_image, NULL);
-   device_data->vtable.FreeMemory(device_data->device, data->font_mem, NULL);
-   device_data->vtable.DestroyBuffer(device_data->device, data->upload_font_buffer, NULL);
-   device_data->vtable.FreeMemory(device_data->device, data->upload_font_buffer_mem, NULL);
+   if (data->compute)
+      device_data->vtable.DestroyDescriptorPool(device_data->device, data->compute_pool, NULL);
 
    ImGui::DestroyContext(data->imgui_context);
 }
@@ -1620,13 +3865,35 @@ static struct overlay_draw *before_present(struct swapchain_data *swapchain_data
 {
    struct overlay_draw *draw = NULL;
 
-   swapchain_data->device->instance->control->processSocket();
-   check_keybinds(swapchain_data->device->instance->params);
+   Control *control = swapchain_data->device->instance->control;
+   struct overlay_params &params = swapchain_data->device->instance->params;
+   check_keybinds(params);
+   /* Nothing shown and images destroyed since were already released,
+    * present as if the layer wasn't there
+    */
+   const uint64_t control_state = control->state();
+   if (params.no_display || control_state == swapchain_data->idle_state)
+      return NULL;
+
+   swapchain_data->snapshot = control->acquire();
+   /* Outside images_mutex, other swapchains keep presenting meanwhile */
+   wait_frames_in_flight(swapchain_data);
+
+   {
+      std::lock_guard<std::mutex> lock(swapchain_data->device->images_mutex);
+      compute_swapchain_display(swapchain_data);
+      draw = render_swapchain_display(swapchain_data, present_queue,
+                                      wait_semaphores, n_wait_semaphores,
+                                      imageIndex);
+   }
 
-   compute_swapchain_display(swapchain_data);
-   draw = render_swapchain_display(swapchain_data, present_queue,
-                                   wait_semaphores, n_wait_semaphores,
-                                   imageIndex);
+   if (draw)
+      draw->snapshot = swapchain_data->snapshot;
+   else
+      control->release(swapchain_data->snapshot);
+   swapchain_data->snapshot = nullptr;
+   if (!(control_state & 1))
+      swapchain_data->idle_state = control_state;
 
    return draw;
 }
@@ -1638,9 +3905,32 @@ static VkResult overlay_CreateSwapchainKHR(
     VkSwapchainKHR*                             pSwapchain)
 {
    struct device_data *device_data = FIND(struct device_data, device);
-   VkResult result = device_data->vtable.CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+
+   /* Compute composite stores to the images, when the surface and format
+    * allow adding storage usage
+    */
+   VkSwapchainCreateInfoKHR create_info = *pCreateInfo;
+   bool compute = false;
+   if (device_data->compute_composite) {
+      VkSurfaceCapabilitiesKHR caps;
+      VkFormatProperties props;
+      if (device_data->instance->vtable.GetPhysicalDeviceSurfaceCapabilitiesKHR(device_data->physical_device,
+                                                                                pCreateInfo->surface,
+                                                                                &caps) == VK_SUCCESS) {
+         device_data->instance->vtable.GetPhysicalDeviceFormatProperties(device_data->physical_device,
+                                                                        pCreateInfo->imageFormat, &props);
+         compute = (caps.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT) &&
+            (props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) &&
+            !(pCreateInfo->flags & VK_SWAPCHAIN_CREATE_MUTABLE_FORMAT_BIT_KHR);
+      }
+      if (compute)
+         create_info.imageUsage |= VK_IMAGE_USAGE_STORAGE_BIT;
+   }
+
+   VkResult result = device_data->vtable.CreateSwapchainKHR(device, &create_info, pAllocator, pSwapchain);
    if (result != VK_SUCCESS) return result;
    struct swapchain_data *swapchain_data = new_swapchain_data(*pSwapchain, device_data);
+   swapchain_data->compute = compute;
    setup_swapchain_data(swapchain_data, pCreateInfo, device_data->instance->params);
 
    return result;
@@ -1738,25 +4028,308 @@ static VkResult overlay_CreateDevice(
    };
    const uint32_t req_extensions_count = sizeof(req_extensions) / sizeof(*req_extensions);
 
-   int new_count = pCreateInfo->enabledExtensionCount + req_extensions_count;
-   const char **exts = (const char**)malloc(sizeof(char*) * new_count);
-   memcpy(exts, pCreateInfo->ppEnabledExtensionNames, sizeof(char*) * pCreateInfo->enabledExtensionCount);
-   for (uint32_t i = 0; i < req_extensions_count; ++i) {
-       exts[pCreateInfo->enabledExtensionCount + i] = req_extensions[i];
+   /* Optional extensions, only enabled when supported */
+   const char *opt_extensions[] = {
+       VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME,
+       VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME,
+       VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+       VK_KHR_MAINTENANCE3_EXTENSION_NAME,
+       VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME,
+       VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
+#ifdef VK_KHR_dynamic_rendering
+       VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+       VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+       VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+       VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+#endif
+   };
+   const uint32_t opt_extensions_count = sizeof(opt_extensions) / sizeof(*opt_extensions);
+
+   uint32_t prop_count = 0;
+   instance_data->vtable.EnumerateDeviceExtensionProperties(physicalDevice, NULL, &prop_count, NULL);
+   std::vector<VkExtensionProperties> props(prop_count);
+   instance_data->vtable.EnumerateDeviceExtensionProperties(physicalDevice, NULL, &prop_count, props.data());
+
+   auto has_extension = [&](const char *name) {
+      for (const VkExtensionProperties &prop : props) {
+         if (!strcmp(prop.extensionName, name))
+            return true;
+      }
+      return false;
+   };
+
+   /* The app's create info and its structs are const, the layer enables
+    * extensions and features in a copy
+    */
+   VkDeviceCreateInfo device_info = *pCreateInfo;
+   std::vector<std::unique_ptr<uint8_t[]>> struct_copies;
+   const bool chain_copied = copy_feature_chain(device_info, struct_copies);
+
+   std::vector<const char*> exts(pCreateInfo->ppEnabledExtensionNames,
+                                 pCreateInfo->ppEnabledExtensionNames + pCreateInfo->enabledExtensionCount);
+   exts.insert(exts.end(), req_extensions, req_extensions + req_extensions_count);
+   bool external_memory_host = false;
+   bool external_semaphore_fd = false;
+   bool descriptor_indexing = false;
+   bool timeline_semaphore = false;
+#ifdef VK_KHR_dynamic_rendering
+   bool dynamic_rendering = false;
+#endif
+   for (uint32_t i = 0; i < opt_extensions_count; ++i) {
+       if (!has_extension(opt_extensions[i]))
+          continue;
+       exts.push_back(opt_extensions[i]);
+       if (!strcmp(opt_extensions[i], VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME))
+          external_memory_host = true;
+       if (!strcmp(opt_extensions[i], VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME))
+          external_semaphore_fd = has_extension(VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME);
+       if (!strcmp(opt_extensions[i], VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME))
+          descriptor_indexing = has_extension(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+       if (!strcmp(opt_extensions[i], VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+          timeline_semaphore = true;
+#ifdef VK_KHR_dynamic_rendering
+       if (!strcmp(opt_extensions[i], VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME))
+          dynamic_rendering = has_extension(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+#endif
    }
-   VkInstanceCreateInfo *i = (VkInstanceCreateInfo*)pCreateInfo;
-   i->enabledExtensionCount = new_count;
-   i->ppEnabledExtensionNames = exts;
+   device_info.enabledExtensionCount = exts.size();
+   device_info.ppEnabledExtensionNames = exts.data();
+
+   /* Features go into the app's struct of the same kind if it has one,
+    * which needs the copied chain
+    */
+   auto find_features = [&](VkStructureType sType, bool &chained) -> VkBaseOutStructure * {
+      for (VkBaseOutStructure *ext = (VkBaseOutStructure*)device_info.pNext; ext; ext = ext->pNext) {
+         if (ext->sType == sType) {
+            chained = true;
+            return chain_copied ? ext : NULL;
+         }
+      }
+      return NULL;
+   };
+
+   /* Bindless images need non uniform indexing into a partially bound
+    * array that is updated while frames using other elements are in flight.
+    */
+   VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {};
+   indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+   if (descriptor_indexing && instance_data->vtable.GetPhysicalDeviceFeatures2KHR) {
+      VkPhysicalDeviceFeatures2 features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+      features2.pNext = &indexing_features;
+      instance_data->vtable.GetPhysicalDeviceFeatures2KHR(physicalDevice, &features2);
+      descriptor_indexing = indexing_features.shaderSampledImageArrayNonUniformIndexing &&
+         indexing_features.runtimeDescriptorArray &&
+         indexing_features.descriptorBindingPartiallyBound &&
+         indexing_features.descriptorBindingSampledImageUpdateAfterBind &&
+         indexing_features.descriptorBindingUpdateUnusedWhilePending;
+   } else {
+      descriptor_indexing = false;
+   }
+   if (descriptor_indexing) {
+      auto enable_indexing = [](auto *features) {
+         features->shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+         features->runtimeDescriptorArray = VK_TRUE;
+         features->descriptorBindingPartiallyBound = VK_TRUE;
+         features->descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+         features->descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+      };
+      /* Enable on top of what the app asked for, in its own struct if it has one */
+      bool chained = false;
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES, chained))
+         enable_indexing((VkPhysicalDeviceVulkan12Features*)ext);
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT, chained))
+         enable_indexing((VkPhysicalDeviceDescriptorIndexingFeaturesEXT*)ext);
+      if (!chained) {
+         indexing_features = {};
+         indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+         indexing_features.pNext = (void*)device_info.pNext;
+         enable_indexing(&indexing_features);
+         device_info.pNext = &indexing_features;
+      } else if (!chain_copied) {
+         descriptor_indexing = false;
+      }
+   }
+
+   /* Compute composite loads and stores swapchain formats that have no
+    * format qualifier, like BGRA8
+    */
+   VkPhysicalDeviceFeatures enabled_features = {};
+   bool storage_without_format = false;
+   if (instance_data->params.compute_composite && !is_blacklisted()) {
+      VkPhysicalDeviceFeatures features;
+      instance_data->vtable.GetPhysicalDeviceFeatures(physicalDevice, &features);
+      storage_without_format = features.shaderStorageImageReadWithoutFormat &&
+         features.shaderStorageImageWriteWithoutFormat;
+   }
+   if (storage_without_format) {
+      VkPhysicalDeviceFeatures *app_features = NULL;
+      bool chained = false;
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, chained))
+         app_features = &((VkPhysicalDeviceFeatures2*)ext)->features;
+      if (!chained) {
+         if (pCreateInfo->pEnabledFeatures)
+            enabled_features = *pCreateInfo->pEnabledFeatures;
+         app_features = &enabled_features;
+         device_info.pEnabledFeatures = &enabled_features;
+      }
+      if (app_features) {
+         app_features->shaderStorageImageReadWithoutFormat = VK_TRUE;
+         app_features->shaderStorageImageWriteWithoutFormat = VK_TRUE;
+      } else {
+         storage_without_format = false;
+      }
+   }
+
+   /* Draws are tracked with a timeline semaphore when supported. Async
+    * uploads also need a transfer only queue family with a queue left over
+    * by the app.
+    */
+   VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {};
+   timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+   if (timeline_semaphore && instance_data->vtable.GetPhysicalDeviceFeatures2KHR && !is_blacklisted()) {
+      VkPhysicalDeviceFeatures2 features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+      features2.pNext = &timeline_features;
+      instance_data->vtable.GetPhysicalDeviceFeatures2KHR(physicalDevice, &features2);
+      timeline_semaphore = timeline_features.timelineSemaphore;
+   } else {
+      timeline_semaphore = false;
+   }
+   if (timeline_semaphore) {
+      bool chained = false;
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES, chained))
+         ((VkPhysicalDeviceVulkan12Features*)ext)->timelineSemaphore = VK_TRUE;
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR, chained))
+         ((VkPhysicalDeviceTimelineSemaphoreFeaturesKHR*)ext)->timelineSemaphore = VK_TRUE;
+      if (!chained) {
+         timeline_features = {};
+         timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+         timeline_features.pNext = (void*)device_info.pNext;
+         timeline_features.timelineSemaphore = VK_TRUE;
+         device_info.pNext = &timeline_features;
+      } else if (!chain_copied) {
+         timeline_semaphore = false;
+      }
+   }
+
+   std::vector<VkDeviceQueueCreateInfo> queue_infos(pCreateInfo->pQueueCreateInfos,
+                                                    pCreateInfo->pQueueCreateInfos + pCreateInfo->queueCreateInfoCount);
+   std::vector<float> transfer_priorities;
+   int transfer_family = -1;
+   uint32_t transfer_index = 0;
+   if (timeline_semaphore) {
+      uint32_t n_family_props;
+      instance_data->vtable.GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &n_family_props, NULL);
+      std::vector<VkQueueFamilyProperties> family_props(n_family_props);
+      instance_data->vtable.GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &n_family_props, family_props.data());
+
+      for (uint32_t f = 0; f < n_family_props && transfer_family < 0; f++) {
+         const VkQueueFlags flags = family_props[f].queueFlags;
+         if (!(flags & VK_QUEUE_TRANSFER_BIT) || (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+            continue;
+         /* Damage rects are copied at any texel offset and size */
+         const VkExtent3D &granularity = family_props[f].minImageTransferGranularity;
+         if (granularity.width != 1 || granularity.height != 1 || granularity.depth != 1)
+            continue;
+         VkDeviceQueueCreateInfo *app_info = NULL;
+         for (VkDeviceQueueCreateInfo &queue_info : queue_infos) {
+            if (queue_info.queueFamilyIndex == f)
+               app_info = &queue_info;
+         }
+         if (app_info && (app_info->flags || app_info->queueCount >= family_props[f].queueCount))
+            continue;
+
+         transfer_family = f;
+         if (app_info) {
+            /* One more queue than the app asked for, ours is the last */
+            transfer_index = app_info->queueCount;
+            transfer_priorities.assign(app_info->pQueuePriorities, app_info->pQueuePriorities + app_info->queueCount);
+            transfer_priorities.push_back(0.5f);
+            app_info->queueCount++;
+            app_info->pQueuePriorities = transfer_priorities.data();
+         } else {
+            transfer_priorities.push_back(0.5f);
+            VkDeviceQueueCreateInfo queue_info = {};
+            queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+            queue_info.queueFamilyIndex = f;
+            queue_info.queueCount = 1;
+            queue_info.pQueuePriorities = transfer_priorities.data();
+            queue_infos.push_back(queue_info);
+         }
+      }
+   }
+#ifdef VK_KHR_dynamic_rendering
+   /* Overlay pass without render pass and framebuffers, barriers through
+    * synchronization2
+    */
+   VkPhysicalDeviceDynamicRenderingFeaturesKHR rendering_features = {};
+   rendering_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+   VkPhysicalDeviceSynchronization2FeaturesKHR sync2_features = {};
+   sync2_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+   if (dynamic_rendering && instance_data->vtable.GetPhysicalDeviceFeatures2KHR && !is_blacklisted()) {
+      VkPhysicalDeviceFeatures2 features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+      features2.pNext = &rendering_features;
+      rendering_features.pNext = &sync2_features;
+      instance_data->vtable.GetPhysicalDeviceFeatures2KHR(physicalDevice, &features2);
+      dynamic_rendering = rendering_features.dynamicRendering && sync2_features.synchronization2;
+   } else {
+      dynamic_rendering = false;
+   }
+   bool rendering_chained = false, sync2_chained = false;
+#ifdef VK_VERSION_1_3
+   if (dynamic_rendering) {
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES, rendering_chained)) {
+         ((VkPhysicalDeviceVulkan13Features*)ext)->dynamicRendering = VK_TRUE;
+         ((VkPhysicalDeviceVulkan13Features*)ext)->synchronization2 = VK_TRUE;
+      }
+      sync2_chained = rendering_chained;
+   }
+#endif
+   if (dynamic_rendering) {
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR, rendering_chained))
+         ((VkPhysicalDeviceDynamicRenderingFeaturesKHR*)ext)->dynamicRendering = VK_TRUE;
+      if (auto ext = find_features(VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR, sync2_chained))
+         ((VkPhysicalDeviceSynchronization2FeaturesKHR*)ext)->synchronization2 = VK_TRUE;
+      if ((rendering_chained || sync2_chained) && !chain_copied)
+         dynamic_rendering = false;
+   }
+   if (dynamic_rendering) {
+      if (!rendering_chained) {
+         rendering_features = {};
+         rendering_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+         rendering_features.pNext = (void*)device_info.pNext;
+         rendering_features.dynamicRendering = VK_TRUE;
+         device_info.pNext = &rendering_features;
+      }
+      if (!sync2_chained) {
+         sync2_features = {};
+         sync2_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+         sync2_features.pNext = (void*)device_info.pNext;
+         sync2_features.synchronization2 = VK_TRUE;
+         device_info.pNext = &sync2_features;
+      }
+   }
+#endif
 
    PFN_vkCreateDevice fpCreateDevice = (PFN_vkCreateDevice)fpGetInstanceProcAddr(NULL, "vkCreateDevice");
    if (fpCreateDevice == NULL) {
       return VK_ERROR_INITIALIZATION_FAILED;
    }
 
-   // Advance the link info for the next element on the chain
+   // Advance the link info for the next element on the chain, in the copy
+   // when the loader's structs were copied
    chain_info->u.pLayerInfo = chain_info->u.pLayerInfo->pNext;
+   VkLayerDeviceCreateInfo *copied_chain_info = get_device_chain_info(&device_info, VK_LAYER_LINK_INFO);
+   if (copied_chain_info != chain_info)
+      copied_chain_info->u.pLayerInfo = chain_info->u.pLayerInfo;
+
+   /* The app's queues are mapped from its own create info later */
+   device_info.queueCreateInfoCount = queue_infos.size();
+   device_info.pQueueCreateInfos = queue_infos.data();
 
-   VkResult result = fpCreateDevice(physicalDevice, pCreateInfo, pAllocator, pDevice);
+   VkResult result = fpCreateDevice(physicalDevice, &device_info, pAllocator, pDevice);
    if (result != VK_SUCCESS) return result;
 
    struct device_data *device_data = new_device_data(*pDevice, instance_data);
@@ -1777,8 +4350,55 @@ static VkResult overlay_CreateDevice(
 
 #undef GETADDR
 
+#ifdef VK_KHR_dynamic_rendering
+   if (dynamic_rendering) {
+      device_data->CmdBeginRenderingKHR = (PFN_vkCmdBeginRenderingKHR)fpGetDeviceProcAddr(*pDevice, "vkCmdBeginRenderingKHR");
+      device_data->CmdEndRenderingKHR = (PFN_vkCmdEndRenderingKHR)fpGetDeviceProcAddr(*pDevice, "vkCmdEndRenderingKHR");
+      device_data->CmdPipelineBarrier2KHR = (PFN_vkCmdPipelineBarrier2KHR)fpGetDeviceProcAddr(*pDevice, "vkCmdPipelineBarrier2KHR");
+      device_data->dynamic_rendering = device_data->CmdBeginRenderingKHR &&
+         device_data->CmdEndRenderingKHR && device_data->CmdPipelineBarrier2KHR;
+   }
+#endif
+
    instance_data->vtable.GetPhysicalDeviceProperties(device_data->physical_device,
                                                      &device_data->properties);
+   instance_data->vtable.GetPhysicalDeviceMemoryProperties(device_data->physical_device,
+                                                           &device_data->memory_properties);
+
+   if (external_memory_host && device_data->vtable.GetMemoryHostPointerPropertiesEXT &&
+       instance_data->vtable.GetPhysicalDeviceProperties2KHR) {
+      VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props = {};
+      host_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+      VkPhysicalDeviceProperties2 props2 = {};
+      props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      props2.pNext = &host_props;
+      instance_data->vtable.GetPhysicalDeviceProperties2KHR(device_data->physical_device, &props2);
+      device_data->external_memory_host = true;
+      device_data->min_imported_host_pointer_alignment = host_props.minImportedHostPointerAlignment;
+   }
+
+   if (external_semaphore_fd && device_data->vtable.ImportSemaphoreFdKHR &&
+       instance_data->vtable.GetPhysicalDeviceExternalSemaphorePropertiesKHR) {
+      VkPhysicalDeviceExternalSemaphoreInfo sem_info = {};
+      sem_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO;
+      sem_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+      VkExternalSemaphoreProperties sem_props = {};
+      sem_props.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES;
+      instance_data->vtable.GetPhysicalDeviceExternalSemaphorePropertiesKHR(device_data->physical_device, &sem_info, &sem_props);
+      device_data->external_semaphore_fd = sem_props.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_IMPORTABLE_BIT;
+   }
+
+   if (descriptor_indexing && instance_data->vtable.GetPhysicalDeviceProperties2KHR) {
+      VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexing_props = {};
+      indexing_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+      VkPhysicalDeviceProperties2 props2 = {};
+      props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      props2.pNext = &indexing_props;
+      instance_data->vtable.GetPhysicalDeviceProperties2KHR(device_data->physical_device, &props2);
+      device_data->descriptor_indexing = true;
+      device_data->max_bindless_images = std::min(indexing_props.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                                                  indexing_props.maxDescriptorSetUpdateAfterBindSampledImages);
+   }
 
    VkLayerDeviceCreateInfo *load_data_info =
       get_device_chain_info(pCreateInfo, VK_LOADER_DATA_CALLBACK);
@@ -1788,6 +4408,23 @@ static VkResult overlay_CreateDevice(
       device_map_queues(device_data, pCreateInfo);
    }
 
+   device_data->storage_without_format = storage_without_format;
+   device_data->timeline_semaphore = timeline_semaphore &&
+      device_data->vtable.GetSemaphoreCounterValueKHR &&
+      device_data->vtable.WaitSemaphoresKHR && device_data->graphic_queue;
+   if (transfer_family >= 0 && device_data->timeline_semaphore) {
+      device_data->vtable.GetDeviceQueue(device_data->device, transfer_family,
+                                         transfer_index, &device_data->transfer_queue);
+      VK_CHECK(device_data->set_device_loader_data(device_data->device,
+                                                   device_data->transfer_queue));
+      device_data->transfer_family = transfer_family;
+   }
+
+   if (!is_blacklisted() && device_data->graphic_queue) {
+      setup_device_pipeline(device_data);
+      setup_device_images(device_data);
+   }
+
    return result;
 }
 
@@ -1798,6 +4435,20 @@ static void overlay_DestroyDevice(
    struct device_data *device_data = FIND(struct device_data, device);
    if (!is_blacklisted())
       device_unmap_queues(device_data);
+   if (device_data->pipeline_cache) {
+      destroy_device_images(device_data);
+      destroy_device_pipeline(device_data);
+   }
+   for (struct overlay_ring_pool *pool : {&device_data->vertex_rings, &device_data->staging_rings}) {
+      if (pool->ring)
+         destroy_ring(device_data, pool->ring);
+      for (struct overlay_ring *ring : pool->retired)
+         destroy_ring(device_data, ring);
+   }
+   for (struct overlay_memory_block *block : device_data->memory_blocks) {
+      device_data->vtable.FreeMemory(device_data->device, block->mem, NULL);
+      delete block;
+   }
    device_data->vtable.DestroyDevice(device, pAllocator);
    destroy_device_data(device_data);
 }
@@ -1808,7 +4459,9 @@ static VkResult overlay_CreateInstance(
     VkInstance*                                 pInstance)
 {
    const char *req_extensions[] = {
+       VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
        VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME,
+       VK_KHR_EXTERNAL_SEMAPHORE_CAPABILITIES_EXTENSION_NAME,
    };
    const uint32_t req_extensions_count = sizeof(req_extensions) / sizeof(*req_extensions);
 
@@ -1849,7 +4502,10 @@ static VkResult overlay_CreateInstance(
    if (!is_blacklisted()) {
       std::cout << "imgoverlay " << IMGOVERLAY_VERSION << std::endl;
       parse_overlay_config(&instance_data->params, getenv("IMGOVERLAY_CONFIG"));
-      instance_data->control = new Control(instance_data->params.socket);
+      instance_data->control = new Control(instance_data->params.socket,
+                                           size_t(instance_data->params.max_image_mem) * 1024 * 1024,
+                                           size_t(instance_data->params.max_total_mem) * 1024 * 1024,
+                                           instance_data->params.max_overlays);
    }
 
    return result;
@@ -1,14 +1,29 @@
 #version 450 core
+#ifdef BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
 layout(location = 0) out vec4 fColor;
 
+#ifdef BINDLESS
+layout(set=0, binding=0) uniform sampler sSampler;
+layout(set=0, binding=1) uniform texture2D sTextures[];
+#else
 layout(set=0, binding=0) uniform sampler2D sTexture;
+#endif
 
 layout(location = 0) in struct{
     vec4 Color;
     vec2 UV;
 } In;
+#ifdef BINDLESS
+layout(location = 2) flat in uint Texture;
+#endif
 
 void main()
 {
+#ifdef BINDLESS
+    fColor = In.Color * texture(sampler2D(sTextures[nonuniformEXT(Texture)], sSampler), In.UV.st);
+#else
     fColor = In.Color * texture(sTexture, In.UV.st);
+#endif
 }
@@ -1,7 +1,14 @@
 #version 450 core
-layout(location = 0) in vec2 aPos;
-layout(location = 1) in vec2 aUV;
+// Image quads: instanced triangle strips, one instance per overlay image
+layout(constant_id = 0) const bool kImageQuads = false;
+
+// ImGui: xy position / uv. Image quads: x, y, width, height / u0, v0, u1, v1
+layout(location = 0) in vec4 aPos;
+layout(location = 1) in vec4 aUV;
 layout(location = 2) in vec4 aColor;
+#ifdef BINDLESS
+layout(location = 3) in uint aTexture;
+#endif
 
 layout(push_constant) uniform uPushConstant{
     vec2 uScale;
@@ -16,10 +23,23 @@ layout(location = 0) out struct{
     vec4 Color;
     vec2 UV;
 } Out;
+#ifdef BINDLESS
+layout(location = 2) flat out uint Texture;
+#endif
 
 void main()
 {
+    vec2 pos = aPos.xy;
+    vec2 uv = aUV.xy;
+    if (kImageQuads) {
+        vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+        pos += corner * aPos.zw;
+        uv = mix(aUV.xy, aUV.zw, corner);
+    }
     Out.Color = aColor;
-    Out.UV = aUV;
-    gl_Position = vec4(aPos*pc.uScale+pc.uTranslate, 0, 1);
+    Out.UV = uv;
+#ifdef BINDLESS
+    Texture = aTexture;
+#endif
+    gl_Position = vec4(pos*pc.uScale+pc.uTranslate, 0, 1);
 }
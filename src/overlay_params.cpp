@@ -39,6 +39,12 @@ parse_string(const char *str)
     return str;
 }
 
+static unsigned
+parse_unsigned(const char *str)
+{
+   return strtoul(str, NULL, 0);
+}
+
 #ifdef HAVE_X11
 static std::vector<KeySym>
 parse_string_to_keysym_vec(const char *str)
@@ -73,6 +79,16 @@ parse_toggle_overlay(const char *str)
 #define parse_socket(s) parse_string(s)
 #define parse_font_scale(s) parse_float(s)
 #define parse_font_size(s) parse_float(s)
+#define parse_max_image_mem(s) parse_unsigned(s)
+#define parse_max_total_mem(s) parse_unsigned(s)
+#define parse_max_frames_in_flight(s) parse_unsigned(s)
+
+/* At least one, pools and the bindless array can't be empty */
+static unsigned
+parse_max_overlays(const char *str)
+{
+   return std::max(parse_unsigned(str), 1u);
+}
 
 static bool
 parse_no_display(const char *str)
@@ -80,6 +96,18 @@ parse_no_display(const char *str)
    return strtol(str, NULL, 0) != 0;
 }
 
+static bool
+parse_skip_busy_frames(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
+static bool
+parse_compute_composite(const char *str)
+{
+   return strtol(str, NULL, 0) != 0;
+}
+
 static bool is_delimiter(char c)
 {
    return c == 0 || c == ',' || c == ':' || c == ';' || c == '=';
@@ -174,6 +202,10 @@ parse_overlay_config(struct overlay_params *params,
 
    params->socket = "/tmp/imgoverlay.socket";
    params->font_scale = 1.0f;
+   params->max_image_mem = 64;
+   params->max_total_mem = 256;
+   params->max_overlays = 16;
+   params->max_frames_in_flight = 2;
 
 #ifdef HAVE_X11
    params->toggle_overlay = { XK_Shift_R, XK_F12 };
@@ -22,6 +22,12 @@ typedef unsigned long KeySym;
    OVERLAY_PARAM_CUSTOM(font_size)                   \
    OVERLAY_PARAM_CUSTOM(font_scale)                  \
    OVERLAY_PARAM_CUSTOM(toggle_overlay)              \
+   OVERLAY_PARAM_CUSTOM(max_image_mem)               \
+   OVERLAY_PARAM_CUSTOM(max_total_mem)               \
+   OVERLAY_PARAM_CUSTOM(max_overlays)                \
+   OVERLAY_PARAM_CUSTOM(max_frames_in_flight)        \
+   OVERLAY_PARAM_CUSTOM(skip_busy_frames)            \
+   OVERLAY_PARAM_CUSTOM(compute_composite)           \
 
 enum overlay_param_enabled {
 #define OVERLAY_PARAM_BOOL(name) OVERLAY_PARAM_ENABLED_##name,
@@ -38,6 +44,11 @@ struct overlay_params {
    std::string socket;
    std::vector<KeySym> toggle_overlay;
    float font_size = 0.0, font_scale = 0.0;
+   unsigned max_image_mem = 0, max_total_mem = 0; // MiB of client shm
+   unsigned max_overlays = 0;
+   unsigned max_frames_in_flight = 0; // overlay draws queued per swapchain
+   bool skip_busy_frames = false; // no overlay instead of waiting for a draw
+   bool compute_composite = false; // blend images with compute into storage capable swapchains
    std::unordered_map<std::string,std::string> options;
 };
 